@@ -23,3 +23,26 @@ g++ \
   -lp3dtoolconfig \
   -lp3dtool \
   -lpthread
+
+g++ \
+  -Wfatal-errors \
+  -c $SCRIPT_PATH/src/main.cxx \
+  -o $SCRIPT_PATH/3d-game-shaders-for-beginners-bake.o \
+  -std=gnu++11 \
+  -O3 \
+  -DBAKE_SCENE \
+  -I/usr/include/python3.9/ \
+  -I$P3D_INCLUDE_PATH
+
+g++ \
+  $SCRIPT_PATH/3d-game-shaders-for-beginners-bake.o \
+  -o $SCRIPT_PATH/3d-game-shaders-for-beginners-bake \
+  -L$P3D_LIB_PATH \
+  -lp3framework \
+  -lpanda \
+  -lpandafx \
+  -lpandaexpress \
+  -lpandaphysics \
+  -lp3dtoolconfig \
+  -lp3dtool \
+  -lpthread
@@ -0,0 +1,56 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+uniform sampler2D colorTexture;
+
+uniform vec2 parameters;
+
+in vec2 texCoord;
+
+out vec4 fragColor;
+
+vec3 threshold(vec3 color) {
+  float value = max(color.r, max(color.g, color.b));
+  return value < parameters.y ? vec3(0.0) : color;
+}
+
+vec3 sampleColor(vec2 offset, vec2 texelSize) {
+  vec3 color = texture(colorTexture, texCoord + offset * texelSize).rgb;
+  return parameters.x == 1 ? threshold(color) : color;
+}
+
+void main() {
+  // The 13 taps are grouped into five overlapping 2x2 boxes.
+  // The center box gets half of the weight.
+
+  vec2 texelSize = 1.0 / textureSize(colorTexture, 0).xy;
+
+  vec3 a = sampleColor(vec2(-2.0,  2.0), texelSize);
+  vec3 b = sampleColor(vec2( 0.0,  2.0), texelSize);
+  vec3 c = sampleColor(vec2( 2.0,  2.0), texelSize);
+
+  vec3 d = sampleColor(vec2(-2.0,  0.0), texelSize);
+  vec3 e = sampleColor(vec2( 0.0,  0.0), texelSize);
+  vec3 f = sampleColor(vec2( 2.0,  0.0), texelSize);
+
+  vec3 g = sampleColor(vec2(-2.0, -2.0), texelSize);
+  vec3 h = sampleColor(vec2( 0.0, -2.0), texelSize);
+  vec3 i = sampleColor(vec2( 2.0, -2.0), texelSize);
+
+  vec3 j = sampleColor(vec2(-1.0,  1.0), texelSize);
+  vec3 k = sampleColor(vec2( 1.0,  1.0), texelSize);
+  vec3 l = sampleColor(vec2(-1.0, -1.0), texelSize);
+  vec3 m = sampleColor(vec2( 1.0, -1.0), texelSize);
+
+  vec3 color  = (j + k + l + m) * 0.5   / 4.0;
+       color += (a + b + d + e) * 0.125 / 4.0;
+       color += (b + c + e + f) * 0.125 / 4.0;
+       color += (d + e + g + h) * 0.125 / 4.0;
+       color += (e + f + h + i) * 0.125 / 4.0;
+
+  fragColor = vec4(color, 1.0);
+}
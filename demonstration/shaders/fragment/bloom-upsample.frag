@@ -0,0 +1,34 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+uniform sampler2D colorTexture;
+uniform sampler2D baseTexture;
+
+uniform vec2 parameters;
+
+in vec2 texCoord;
+
+out vec4 fragColor;
+
+void main() {
+  // A 3x3 tent filter over the smaller level.
+
+  vec2 texelSize = parameters.x / textureSize(colorTexture, 0).xy;
+
+  vec3 color  = texture(colorTexture, texCoord + vec2(-1.0,  1.0) * texelSize).rgb * 1.0;
+       color += texture(colorTexture, texCoord + vec2( 0.0,  1.0) * texelSize).rgb * 2.0;
+       color += texture(colorTexture, texCoord + vec2( 1.0,  1.0) * texelSize).rgb * 1.0;
+       color += texture(colorTexture, texCoord + vec2(-1.0,  0.0) * texelSize).rgb * 2.0;
+       color += texture(colorTexture, texCoord + vec2( 0.0,  0.0) * texelSize).rgb * 4.0;
+       color += texture(colorTexture, texCoord + vec2( 1.0,  0.0) * texelSize).rgb * 2.0;
+       color += texture(colorTexture, texCoord + vec2(-1.0, -1.0) * texelSize).rgb * 1.0;
+       color += texture(colorTexture, texCoord + vec2( 0.0, -1.0) * texelSize).rgb * 2.0;
+       color += texture(colorTexture, texCoord + vec2( 1.0, -1.0) * texelSize).rgb * 1.0;
+       color /= 16.0;
+
+  fragColor = vec4(texture(baseTexture, texCoord).rgb + color, 1.0);
+}
@@ -8,43 +8,20 @@
 uniform sampler2D colorTexture;
 
 uniform vec2 enabled;
+uniform vec2 parameters;
+
+in vec2 texCoord;
 
 out vec4 fragColor;
 
 void main() {
-  int   size       = 3;
-  float separation = 4.0;
-  float threshold  = 0.6;
-  float amount     = 0.6;
-
-  if (enabled.x != 1 || size <= 0) { fragColor = vec4(0); return; }
-
-  vec2 texSize = textureSize(colorTexture, 0).xy;
-
-  vec4 result = vec4(0.0);
-  vec4 color  = vec4(0.0);
-
-  float value = 0.0;
-  float count = 0.0;
-
-  for (int i = -size; i <= size; ++i) {
-    for (int j = -size; j <= size; ++j) {
-      color =
-        texture
-          ( colorTexture
-          ,   (vec2(i, j) * separation + gl_FragCoord.xy)
-            / texSize
-          );
+  float amount = 0.6;
 
-      value = max(color.r, max(color.g, color.b));
-      if (value < threshold) { color = vec4(0.0); }
+  if (enabled.x != 1) { fragColor = vec4(0); return; }
 
-      result += color;
-      count  += 1.0;
-    }
-  }
+  // The upsampled chain holds the sum of every level.
 
-  result /= count;
+  vec4 result = vec4(texture(colorTexture, texCoord).rgb / max(parameters.x, 1.0), 1.0);
 
   fragColor = mix(vec4(0.0), result, amount);
 }
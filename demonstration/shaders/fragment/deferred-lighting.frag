@@ -0,0 +1,70 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+#pragma include "shaders/include/lighting.glsl"
+
+uniform sampler2D positionTexture;
+uniform sampler2D normalTexture;
+uniform sampler2D diffuseTexture;
+uniform sampler2D specularMapTexture;
+uniform sampler2D emissionTexture;
+
+out vec4 out0;
+out vec4 out1;
+out vec4 out2;
+
+void main() {
+  vec2 texSize  = textureSize(positionTexture, 0).xy;
+  vec2 texCoord = gl_FragCoord.xy / texSize;
+
+  vec4 vertexPosition = texture(positionTexture, texCoord);
+
+  // Nothing was rasterized here so leave it for the background.
+  if (vertexPosition.a <= 0.0) { out0 = vec4(0.0); out1 = vec4(0.0); out2 = vec4(0.0); return; }
+
+  vec3 normal       = normalize(texture(normalTexture, texCoord).xyz);
+  vec4 diffuseColor = texture(diffuseTexture, texCoord);
+  vec4 specularMap  = texture(specularMapTexture, texCoord);
+
+  diffuseColor.rgb = pow(diffuseColor.rgb, vec3(gamma.x));
+
+  // The geometry buffer only has the view space position
+  // so each light's shadow map lookup is worked out here instead of in the vertex shader.
+  vec4 vertexInShadowSpaces[NUMBER_OF_LIGHTS];
+  for (int i = 0; i < NUMBER_OF_LIGHTS; ++i) {
+    vertexInShadowSpaces[i] = p3d_LightSource[i].shadowViewMatrix * vertexPosition;
+  }
+
+  vec4 diffuse;
+  vec4 specular;
+
+  calculateLightSources
+    ( vertexPosition
+    , normal
+    , diffuseColor
+    , specularMap
+    , vertexInShadowSpaces
+    , 0.0
+    , diffuse
+    , specular
+    );
+
+  vec3 rimLight = calculateRimLight(vertexPosition, normal, diffuse.rgb);
+  vec3 ambient  = calculateAmbientLight(normal, diffuseColor.rgb);
+  vec3 emission = calculateEmission(texture(emissionTexture, texCoord).rgb);
+
+  out0.a   =   diffuseColor.a;
+  out0.rgb =   ambient.rgb
+             + diffuse.rgb
+             + rimLight.rgb
+             + emission.rgb;
+
+  out1.a   = diffuseColor.a;
+  out1.rgb = specular.rgb;
+
+  out2 = vec4(0.0);
+}
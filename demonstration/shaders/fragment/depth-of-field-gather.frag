@@ -0,0 +1,64 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+uniform sampler2D colorTexture;
+uniform sampler2D tileTexture;
+
+uniform vec2 parameters;
+uniform vec2 enabled;
+
+in vec2 texCoord;
+
+out vec4 fragColor;
+
+void main() {
+  int   size         = int(parameters.x);
+  float separation   =     parameters.y;
+  float minThreshold = 0.2;
+  float maxThreshold = 0.5;
+
+  fragColor = texture(colorTexture, texCoord);
+
+  // Every pixel near this tile is in focus so nothing will read the blur.
+  if (enabled.x != 1 || size <= 0 || texture(tileTexture, texCoord).g <= 0.0) { return; }
+
+  vec2 texelSize = separation / textureSize(colorTexture, 0).xy;
+
+  vec3  average = vec3(0.0);
+  float count   = 0.0;
+
+  float  mx = 0.0;
+  vec3  cmx = fragColor.rgb;
+
+  for (int i = -size; i <= size; ++i) {
+    for (int j = -size; j <= size; ++j) {
+      if (!(distance(vec2(i, j), vec2(0, 0)) <= size)) { continue; }
+
+      vec3 c = texture(colorTexture, texCoord + vec2(i, j) * texelSize).rgb;
+
+      average += c;
+      count   += 1.0;
+
+      float mxt = dot(c, vec3(0.3, 0.59, 0.11));
+
+      if (mxt > mx) {
+         mx = mxt;
+        cmx = c;
+      }
+    }
+  }
+
+  average /= count;
+
+  // Push the bright parts outward like the dilation filter would.
+  fragColor.rgb =
+    mix
+      ( average
+      , cmx
+      , smoothstep(minThreshold, maxThreshold, mx)
+      );
+}
@@ -0,0 +1,34 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+uniform sampler2D tileTexture;
+
+out vec4 fragColor;
+
+void main() {
+  ivec2 texSize  = textureSize(tileTexture, 0).xy;
+  ivec2 texCoord = ivec2(floor(gl_FragCoord.xy));
+
+  float minBlur = 1.0;
+  float maxBlur = 0.0;
+
+  for (int i = -1; i <= 1; ++i) {
+    for (int j = -1; j <= 1; ++j) {
+      vec4 tile =
+        texelFetch
+          ( tileTexture
+          , clamp(texCoord + ivec2(i, j), ivec2(0), texSize - 1)
+          , 0
+          );
+
+      minBlur = min(minBlur, tile.r);
+      maxBlur = max(maxBlur, tile.g);
+    }
+  }
+
+  fragColor = vec4(minBlur, maxBlur, 0.0, 1.0);
+}
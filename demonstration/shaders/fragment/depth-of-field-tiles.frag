@@ -0,0 +1,51 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+uniform sampler2D positionTexture;
+
+uniform vec2 mouseFocusPoint;
+uniform vec2 parameters;
+
+out vec4 fragColor;
+
+void main() {
+  float minDistance =  8.0;
+  float maxDistance = 12.0;
+
+  int tileSize = int(parameters.x);
+
+  ivec2 texSize  = textureSize(positionTexture, 0).xy;
+  ivec2 tileBase = ivec2(floor(gl_FragCoord.xy)) * tileSize;
+
+  vec4 focusPoint = texture(positionTexture, mouseFocusPoint);
+
+  float minBlur = 1.0;
+  float maxBlur = 0.0;
+
+  for (int i = 0; i < tileSize; ++i) {
+    for (int j = 0; j < tileSize; ++j) {
+      ivec2 texCoord = min(tileBase + ivec2(i, j), texSize - 1);
+
+      vec4 position = texelFetch(positionTexture, texCoord, 0);
+
+      // The background is never blurred.
+      float blur =
+          position.a <= 0
+        ? 0.0
+        : smoothstep
+            ( minDistance
+            , maxDistance
+            , length(position - focusPoint)
+            );
+
+      minBlur = min(minBlur, blur);
+      maxBlur = max(maxBlur, blur);
+    }
+  }
+
+  fragColor = vec4(minBlur, maxBlur, 0.0, 1.0);
+}
@@ -9,6 +9,7 @@ uniform sampler2D positionTexture;
 uniform sampler2D noiseTexture;
 uniform sampler2D focusTexture;
 uniform sampler2D outOfFocusTexture;
+uniform sampler2D tileTexture;
 
 uniform vec2 mouseFocusPoint;
 uniform vec2 nearFar;
@@ -36,6 +37,8 @@ void main() {
 
   if (position.a <= 0) { fragColor1 = vec4(1.0); return; }
 
+  if (texture(tileTexture, texCoord).g <= 0.0) { fragColor1 = vec4(0.0); return; }
+
   vec4 outOfFocusColor = texture(outOfFocusTexture, texCoord);
   vec4 focusPoint      = texture(positionTexture,   mouseFocusPoint);
 
@@ -0,0 +1,9 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+void main() {
+}
@@ -11,8 +11,7 @@ uniform vec2 gamma;
 uniform vec4 backgroundColor0;
 uniform vec4 backgroundColor1;
 
-uniform sampler2D positionTexture0;
-uniform sampler2D positionTexture1;
+uniform sampler2D positionTexture;
 uniform sampler2D smokeMaskTexture;
 
 uniform vec3 origin;
@@ -28,27 +27,17 @@ void main() {
 
   if (enabled.x != 1) { fragColor = vec4(0); return; }
 
-  vec2 texSize  = textureSize(positionTexture0, 0).xy;
+  vec2 texSize  = textureSize(positionTexture, 0).xy;
   vec2 texCoord = gl_FragCoord.xy / texSize;
 
-  vec4 smokeMask    = texture(smokeMaskTexture, texCoord);
-  vec4 position0    = texture(positionTexture0, texCoord);
-       position0.y -= origin.y;
+  vec4 smokeMask = texture(smokeMaskTexture, texCoord);
 
   float near = nearFar.x;
   float far  = nearFar.y;
 
-  vec4 position1    = texture(positionTexture1, texCoord);
-       position1.y -= origin.y;
-  if (position1.a <= 0) { position1.y = far; }
-
-  vec4 position = position1;
-
-  if        (position0.a <= 0 && smokeMask.r > 0) {
-    position.y   = mix(far,           position1.y,   smokeMask.r);
-  } else if (position0.a >  0 && smokeMask.r > 0) {
-    position.xyz = mix(position0.xyz, position1.xyz, smokeMask.r);
-  }
+  vec4 position    = texture(positionTexture, texCoord);
+       position.y -= origin.y;
+  if (position.a <= 0) { position.y = far; }
 
   float random =
     fract
@@ -89,5 +78,11 @@ void main() {
       , fogMax
       );
 
+  // The smoke pass blends its coverage into red and its own fog depth into green.
+  if (smokeMask.r > 0) {
+    float smokeIntensity = clamp(smokeMask.g / smokeMask.r, fogMin, fogMax);
+    intensity = mix(intensity, smokeIntensity, smokeMask.r);
+  }
+
   fragColor = vec4(color.rgb, intensity);
 }
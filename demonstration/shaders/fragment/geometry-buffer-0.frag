@@ -5,7 +5,14 @@
 
 #version 150
 
+uniform sampler2D p3d_Texture0;
 uniform sampler2D p3d_Texture1;
+uniform sampler2D p3d_Texture2;
+
+uniform struct
+  { vec4 emission
+  ;
+  } p3d_Material;
 
 uniform vec2 normalMapsEnabled;
 
@@ -16,9 +23,13 @@ in vec3 binormal;
 in vec3 tangent;
 
 in vec2 normalCoord;
+in vec2 diffuseCoord;
 
 out vec4 positionOut;
 out vec4 normalOut;
+out vec4 diffuseOut;
+out vec4 specularMapOut;
+out vec4 emissionOut;
 
 void main() {
   vec4 normalTex =
@@ -29,12 +40,8 @@ void main() {
 
   vec3 normal;
   if (normalMapsEnabled.x == 1) {
-    normal =
-      normalize
-        ( normalTex.rgb
-        * 2.0
-        - 1.0
-        );
+    normal   = vec3(normalTex.rg * 2.0 - 1.0, 0.0);
+    normal.z = sqrt(clamp(1.0 - dot(normal.xy, normal.xy), 0.0, 1.0));
     normal =
       normalize
         ( mat3
@@ -48,6 +55,9 @@ void main() {
     normal = normalize(vertexNormal);
   }
 
-  positionOut = vertexPosition;
-  normalOut   = vec4(normal, 1);
+  positionOut    = vertexPosition;
+  normalOut      = vec4(normal, 1);
+  diffuseOut     = texture(p3d_Texture0, diffuseCoord);
+  specularMapOut = texture(p3d_Texture2, diffuseCoord);
+  emissionOut    = vec4(p3d_Material.emission.rgb, 1);
 }
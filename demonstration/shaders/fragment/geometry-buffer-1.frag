@@ -60,12 +60,8 @@ void main() {
             )
         );
 
-    normal =
-      normalize
-        ( normalTex.rgb
-        * 2.0
-        - 1.0
-        );
+    normal   = vec3(normalTex.rg * 2.0 - 1.0, 0.0);
+    normal.z = sqrt(clamp(1.0 - dot(normal.xy, normal.xy), 0.0, 1.0));
     normal =
       normalize
         ( mat3
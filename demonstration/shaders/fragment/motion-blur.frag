@@ -5,12 +5,11 @@
 
 #version 150
 
-uniform sampler2D positionTexture;
-uniform sampler2D colorTexture;
+#define MAX_SAMPLES 16
 
-uniform mat4 previousViewWorldMat;
-uniform mat4 worldViewMat;
-uniform mat4 lensProjection;
+uniform sampler2D velocityTexture;
+uniform sampler2D tileTexture;
+uniform sampler2D colorTexture;
 
 uniform vec2 motionBlurEnabled;
 uniform vec2 parameters;
@@ -24,33 +23,38 @@ void main() {
   vec2 texSize  = textureSize(colorTexture, 0).xy;
   vec2 texCoord = gl_FragCoord.xy / texSize;
 
-       fragColor = texture(colorTexture,    texCoord);
-  vec4 position1 = texture(positionTexture, texCoord);
+  fragColor = texture(colorTexture, texCoord);
 
-  if (size <= 0 || separation <= 0.0 || motionBlurEnabled.x != 1 || position1.a <= 0.0) { return; }
+  if (size <= 0 || separation <= 0.0 || motionBlurEnabled.x != 1) { return; }
 
-  vec4 position0 = worldViewMat * previousViewWorldMat * position1;
+  // Nothing near this tile moved more than half a pixel.
+  vec2 tileVelocity = texture(tileTexture, texCoord).xy * texSize;
+  if (length(tileVelocity) < 0.5) { return; }
 
-  position0      = lensProjection * position0;
-  position0.xyz /= position0.w;
-  position0.xy   = position0.xy * 0.5 + 0.5;
+  vec2 velocity = texture(velocityTexture, texCoord).xy;
 
-  position1      = lensProjection * position1;
-  position1.xyz /= position1.w;
-  position1.xy   = position1.xy * 0.5 + 0.5;
+  if (length(velocity) <= 0.0) { return; }
 
-  vec2 direction = position1.xy - position0.xy;
+  vec2 direction = velocity * size * separation;
 
-  if (length(direction) <= 0.0) { return; }
+  // Take about one sample per pixel the fastest neighbor moved.
+  int samples =
+    int
+      ( clamp
+          ( ceil(length(tileVelocity) * size * separation)
+          , 1.0
+          , float(MAX_SAMPLES)
+          )
+      );
 
-  direction.xy *= separation;
+  direction /= float(samples);
 
   vec2 forward  = texCoord;
   vec2 backward = texCoord;
 
   float count = 1.0;
 
-  for (int i = 0; i < size; ++i) {
+  for (int i = 0; i < samples; ++i) {
     forward  += direction;
     backward -= direction;
 
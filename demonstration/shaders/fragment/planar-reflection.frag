@@ -0,0 +1,40 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+#define MAX_BLUR_LEVEL 5.0
+#define DISTORTION     0.05
+
+uniform sampler2D colorTexture;
+uniform sampler2D maskTexture;
+uniform sampler2D normalTexture;
+
+uniform vec3 planeNormal;
+uniform vec2 enabled;
+
+out vec4 fragColor;
+
+void main() {
+  vec2 texSize  = textureSize(maskTexture, 0).xy;
+  vec2 texCoord = gl_FragCoord.xy / texSize;
+
+  vec4 mask = texture(maskTexture, texCoord);
+
+  float amount = clamp(mask.r, 0.0, 1.0);
+
+  if (amount <= 0.0 || enabled.x != 1.0) { fragColor = vec4(0.0); return; }
+
+  float roughness = clamp(mask.g, 0.0, 1.0);
+
+  // The mirrored view lines up with the screen so the ripples only need to nudge where it's read.
+  vec3 normal = normalize(texture(normalTexture, texCoord).xyz);
+  vec2 uv     = texCoord + (normal.xz - normalize(planeNormal).xz) * DISTORTION;
+
+  // Each mipmap level is twice as blurry as the last.
+  vec4 color = textureLod(colorTexture, uv, roughness * MAX_BLUR_LEVEL);
+
+  fragColor = color * amount;
+}
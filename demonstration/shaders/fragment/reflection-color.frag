@@ -7,6 +7,7 @@
 
 uniform sampler2D uvTexture;
 uniform sampler2D colorTexture;
+uniform sampler2D backgroundColorTexture;
 
 out vec4 fragColor;
 
@@ -43,6 +44,9 @@ void main() {
   if (uv.b <= 0.0) { fragColor = vec4(0.0); return;}
 
   vec4  color = texture(colorTexture, uv.xy);
+
+  // The refraction pass only draws around the water so elsewhere it's the background.
+  if (color.a <= 0.0) { color = texture(backgroundColorTexture, uv.xy); }
   float alpha = clamp(uv.b, 0.0, 1.0);
 
   fragColor = vec4(mix(vec3(0.0), color.rgb, alpha), alpha);
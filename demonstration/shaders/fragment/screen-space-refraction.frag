@@ -5,6 +5,14 @@
 
 #version 150
 
+// The quality preset may define these ahead of time.
+#ifndef STEPS
+#define STEPS 5
+#endif
+#ifndef RESOLUTION
+#define RESOLUTION 0.3
+#endif
+
 uniform mat4 lensProjection;
 
 uniform sampler2D positionFromTexture;
@@ -18,8 +26,8 @@ out vec4 fragColor;
 
 void main() {
   float maxDistance = 5;
-  float resolution  = 0.3;
-  int   steps       = 5;
+  float resolution  = RESOLUTION;
+  int   steps       = STEPS;
   float thickness   = 0.5;
 
   vec2 texSize  = textureSize(positionFromTexture, 0).xy;
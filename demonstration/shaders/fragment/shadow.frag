@@ -0,0 +1,15 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+uniform sampler2D p3d_Texture0;
+
+in vec2 diffuseCoord;
+
+void main() {
+  // Cut out leaves and the like so they cast the shadow of their shape.
+  if (texture(p3d_Texture0, diffuseCoord).a < 0.5) { discard; }
+}
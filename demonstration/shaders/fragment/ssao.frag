@@ -5,8 +5,13 @@
 
 #version 150
 
+// The quality preset may define these ahead of time.
+#ifndef NUM_SAMPLES
 #define NUM_SAMPLES 8
+#endif
+#ifndef NUM_NOISE
 #define NUM_NOISE   4
+#endif
 
 uniform mat4 lensProjection;
 
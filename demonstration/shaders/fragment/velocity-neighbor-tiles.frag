@@ -0,0 +1,38 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+uniform sampler2D tileTexture;
+
+out vec4 fragColor;
+
+void main() {
+  ivec2 texSize  = textureSize(tileTexture, 0).xy;
+  ivec2 texCoord = ivec2(floor(gl_FragCoord.xy));
+
+  vec2  maxVelocity = vec2(0.0);
+  float maxLength   = 0.0;
+
+  for (int i = -1; i <= 1; ++i) {
+    for (int j = -1; j <= 1; ++j) {
+      vec2 velocity =
+        texelFetch
+          ( tileTexture
+          , clamp(texCoord + ivec2(i, j), ivec2(0), texSize - 1)
+          , 0
+          ).xy;
+
+      float velocityLength = dot(velocity, velocity);
+
+      if (velocityLength > maxLength) {
+        maxLength   = velocityLength;
+        maxVelocity = velocity;
+      }
+    }
+  }
+
+  fragColor = vec4(maxVelocity, 0.0, 1.0);
+}
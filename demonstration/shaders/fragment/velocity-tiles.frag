@@ -0,0 +1,42 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+uniform sampler2D velocityTexture;
+
+uniform vec2 parameters;
+
+out vec4 fragColor;
+
+void main() {
+  int tileSize = int(parameters.x);
+
+  ivec2 texSize  = textureSize(velocityTexture, 0).xy;
+  ivec2 tileBase = ivec2(floor(gl_FragCoord.xy)) * tileSize;
+
+  vec2  maxVelocity = vec2(0.0);
+  float maxLength   = 0.0;
+
+  for (int i = 0; i < tileSize; ++i) {
+    for (int j = 0; j < tileSize; ++j) {
+      vec2 velocity =
+        texelFetch
+          ( velocityTexture
+          , min(tileBase + ivec2(i, j), texSize - 1)
+          , 0
+          ).xy;
+
+      float velocityLength = dot(velocity, velocity);
+
+      if (velocityLength > maxLength) {
+        maxLength   = velocityLength;
+        maxVelocity = velocity;
+      }
+    }
+  }
+
+  fragColor = vec4(maxVelocity, 0.0, 1.0);
+}
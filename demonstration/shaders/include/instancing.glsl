@@ -0,0 +1,17 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+// Shared by every vertex shader that can draw the instanced props.
+// Each instance is a rotation quaternion, then the offset in xyz and the uniform scale in w.
+
+uniform vec2 isInstanced;
+
+in vec4 instanceRotation;
+in vec4 instanceOffset;
+
+vec3 rotateByInstance(vec3 v) {
+  vec3 q = instanceRotation.xyz;
+  return v + 2.0 * cross(q, cross(q, v) + instanceRotation.w * v);
+}
@@ -0,0 +1,258 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+// Shared by base.frag and deferred-lighting.frag so the forward and deferred paths light the scene the same.
+// The planar reflection is only seen blurred and rippled so it goes without shadows and SSAO.
+
+#define NUMBER_OF_LIGHTS    4
+#define MAX_SHININESS     127.75
+#define MAX_FRESNEL_POWER   5.0
+#define SHADOW_SAMPLES      2
+
+uniform vec2 pi;
+uniform vec2 gamma;
+
+uniform mat4 trans_view_to_world;
+
+uniform sampler2D ssaoBlurTexture;
+
+uniform struct p3d_LightSourceParameters
+  { vec4 color
+
+  ; vec4 ambient
+  ; vec4 diffuse
+  ; vec4 specular
+
+  ; vec4 position
+
+  ; vec3  spotDirection
+  ; float spotExponent
+  ; float spotCutoff
+  ; float spotCosCutoff
+
+  ; float constantAttenuation
+  ; float linearAttenuation
+  ; float quadraticAttenuation
+
+  ; vec3 attenuation
+
+  ; sampler2DShadow shadowMap
+
+  ; mat4 shadowViewMatrix
+  ;
+  } p3d_LightSource[NUMBER_OF_LIGHTS];
+
+uniform vec2 fresnelEnabled;
+uniform vec2 rimLightEnabled;
+uniform vec2 blinnPhongEnabled;
+uniform vec2 celShadingEnabled;
+uniform vec2 sunPosition;
+
+vec3 shadowColor() {
+  return pow(vec3(0.149, 0.220, 0.227), vec3(gamma.x));
+}
+
+// Adds up the diffuse and specular of every light.
+// The particles are lit but take no specular and cast no shadows on themselves.
+
+void calculateLightSources
+  ( vec4  vertexPosition
+  , vec3  normal
+  , vec4  diffuseColor
+  , vec4  specularMap
+  , vec4  vertexInShadowSpaces[NUMBER_OF_LIGHTS]
+  , float isParticle
+  , out vec4 diffuse
+  , out vec4 specular
+  ) {
+  diffuse  = vec4(0.0, 0.0, 0.0, diffuseColor.a);
+  specular = vec4(0.0, 0.0, 0.0, diffuseColor.a);
+
+  for (int i = 0; i < p3d_LightSource.length(); ++i) {
+    vec3 lightDirection =
+        p3d_LightSource[i].position.xyz
+      - vertexPosition.xyz
+      * p3d_LightSource[i].position.w;
+
+    vec3 unitLightDirection = normalize(lightDirection);
+    vec3 eyeDirection       = normalize(-vertexPosition.xyz);
+    vec3 reflectedDirection = normalize(-reflect(unitLightDirection, normal));
+    vec3 halfwayDirection   = normalize(unitLightDirection + eyeDirection);
+
+    float lightDistance = length(lightDirection);
+
+    float attenuation =
+        1.0
+      / ( p3d_LightSource[i].constantAttenuation
+        + p3d_LightSource[i].linearAttenuation
+        * lightDistance
+        + p3d_LightSource[i].quadraticAttenuation
+        * (lightDistance * lightDistance)
+        );
+
+    if (attenuation <= 0.0) { continue; }
+
+    float diffuseIntensity = dot(normal, unitLightDirection);
+
+    if (diffuseIntensity < 0.0) { continue; }
+
+    diffuseIntensity =
+        celShadingEnabled.x == 1
+      ? smoothstep(0.1, 0.2, diffuseIntensity)
+      : diffuseIntensity;
+
+    vec4 lightDiffuseColor     = p3d_LightSource[i].diffuse;
+         lightDiffuseColor.rgb = pow(lightDiffuseColor.rgb, vec3(gamma.x));
+
+    vec4 diffuseTemp =
+      vec4
+        ( clamp
+            (   diffuseColor.rgb
+              * lightDiffuseColor.rgb
+              * diffuseIntensity
+            , 0.0
+            , 1.0
+            )
+        , diffuseColor.a
+        );
+
+    float specularIntensity =
+      ( blinnPhongEnabled.x == 1
+      ? clamp(dot(normal,       halfwayDirection),   0.0, 1.0)
+      : clamp(dot(eyeDirection, reflectedDirection), 0.0, 1.0)
+      );
+
+    specularIntensity =
+      ( celShadingEnabled.x == 1
+      ? smoothstep(0.9, 1.0, specularIntensity)
+      : specularIntensity
+      );
+
+    vec4  lightSpecularColor     = p3d_LightSource[i].specular;
+          lightSpecularColor.rgb = pow(lightSpecularColor.rgb, vec3(gamma.x));
+
+    vec4 materialSpecularColor        = vec4(vec3(specularMap.r), diffuseColor.a);
+    if (fresnelEnabled.x == 1) {
+      float fresnelFactor             = dot((blinnPhongEnabled.x == 1 ? halfwayDirection : normal), eyeDirection);
+            fresnelFactor             = max(fresnelFactor, 0.0);
+            fresnelFactor             = 1.0 - fresnelFactor;
+            fresnelFactor             = pow(fresnelFactor, specularMap.b * MAX_FRESNEL_POWER);
+            materialSpecularColor.rgb = mix(materialSpecularColor.rgb, vec3(1.0), clamp(fresnelFactor, 0.0, 1.0));
+    }
+
+    vec4 specularTemp      = vec4(vec3(0.0), diffuseColor.a);
+         specularTemp.rgb  = lightSpecularColor.rgb * pow(specularIntensity, specularMap.g * MAX_SHININESS);
+         specularTemp.rgb *= materialSpecularColor.rgb;
+         specularTemp.rgb *= (1 - isParticle);
+         specularTemp.rgb  = clamp(specularTemp.rgb, 0.0, 1.0);
+
+    float unitLightDirectionDelta =
+      dot
+        ( normalize(p3d_LightSource[i].spotDirection)
+        , -unitLightDirection
+        );
+
+    if (unitLightDirectionDelta < p3d_LightSource[i].spotCosCutoff) { continue; }
+
+    float spotExponent = p3d_LightSource[i].spotExponent;
+
+    diffuseTemp.rgb *= (spotExponent <= 0.0 ? 1.0 : pow(unitLightDirectionDelta, spotExponent));
+
+#ifndef PLANAR_REFLECTION
+    vec2  shadowMapSize = textureSize(p3d_LightSource[i].shadowMap, 0);
+    float inShadow      = 0.0;
+    float count         = 0.0;
+
+    for (  int si = -SHADOW_SAMPLES; si <= SHADOW_SAMPLES; ++si) {
+      for (int sj = -SHADOW_SAMPLES; sj <= SHADOW_SAMPLES; ++sj) {
+        inShadow +=
+          ( 1.0
+          - textureProj
+              ( p3d_LightSource[i].shadowMap
+              , vertexInShadowSpaces[i] + vec4(vec2(si, sj) / shadowMapSize, vec2(0.0))
+              )
+          );
+
+        count += 1.0;
+      }
+    }
+
+    inShadow /= count;
+
+    vec3 shadow =
+      mix
+        ( vec3(1.0)
+        , shadowColor()
+        , inShadow
+        );
+
+    diffuseTemp.rgb  *= mix(shadow, vec3(1.0), isParticle);
+    specularTemp.rgb *= mix(shadow, vec3(1.0), isParticle);
+#endif
+
+    diffuseTemp.rgb  *= attenuation;
+    specularTemp.rgb *= attenuation;
+
+    diffuse.rgb  += diffuseTemp.rgb;
+    specular.rgb += specularTemp.rgb;
+  }
+}
+
+vec3 calculateRimLight(vec4 vertexPosition, vec3 normal, vec3 diffuse) {
+  if (rimLightEnabled.x != 1) { return vec3(0.0); }
+
+  vec3 rim =
+    vec3
+      ( 1.0
+      - max
+          ( 0.0
+          , dot(normalize(-vertexPosition.xyz), normalize(normal))
+          )
+      );
+  rim =
+    ( celShadingEnabled.x == 1
+    ? smoothstep(0.3, 0.4, rim)
+    : pow(rim, vec3(2.0)) * 1.2
+    );
+
+  return rim * diffuse;
+}
+
+// The sky and ground tint the ambient light depending on where the sun is and which way the surface faces.
+
+vec3 calculateAmbientLight(vec3 normal, vec3 diffuseColor) {
+#ifdef PLANAR_REFLECTION
+  vec3 ssao             = vec3(1.0);
+#else
+  vec2 ssaoBlurTexSize  = textureSize(ssaoBlurTexture, 0).xy;
+  vec2 ssaoBlurTexCoord = gl_FragCoord.xy / ssaoBlurTexSize;
+  vec3 ssao             = texture(ssaoBlurTexture, ssaoBlurTexCoord).rgb;
+       ssao             = mix(shadowColor(), vec3(1.0), clamp(ssao.r, 0.0, 1.0));
+#endif
+
+  float sunPosition  = sin(sunPosition.x * pi.y);
+  float sunMixFactor = 1.0 - (sunPosition / 2.0 + 0.5);
+
+  vec3 ambientCool = pow(vec3(0.302, 0.451, 0.471), vec3(gamma.x)) * max(0.5, sunMixFactor);
+  vec3 ambientWarm = pow(vec3(0.765, 0.573, 0.400), vec3(gamma.x)) * max(0.5, sunMixFactor);
+
+  vec3 skyLight    = mix(ambientCool, ambientWarm, sunMixFactor);
+  vec3 groundLight = mix(ambientWarm, ambientCool, sunMixFactor);
+
+  vec3 worldNormal = normalize((trans_view_to_world * vec4(normal, 0.0)).xyz);
+
+  vec3 skyGroundLight =
+    mix
+      ( groundLight
+      , skyLight
+      , 0.5 * (1.0 + dot(worldNormal, vec3(0, 0, 1)))
+      );
+
+  return skyGroundLight * diffuseColor * ssao;
+}
+
+vec3 calculateEmission(vec3 emission) {
+  return emission * max(0.1, pow(sin(sunPosition.x * pi.y), 0.4));
+}
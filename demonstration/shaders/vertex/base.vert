@@ -5,12 +5,18 @@
 
 #version 150
 
+#pragma include "shaders/include/instancing.glsl"
+
 #define NUMBER_OF_LIGHTS 4
 
 uniform mat4 p3d_ModelViewMatrix;
 uniform mat4 p3d_ProjectionMatrix;
 uniform mat3 p3d_NormalMatrix;
 
+#ifdef PLANAR_REFLECTION
+uniform vec4 p3d_ClipPlane[1];
+#endif
+
 uniform struct p3d_LightSourceParameters
   { vec4 color
 
@@ -61,12 +67,25 @@ out vec2 diffuseCoord;
 out vec4 vertexInShadowSpaces[NUMBER_OF_LIGHTS];
 
 void main() {
+  vec4 vertex = p3d_Vertex;
+  vec3 normal = p3d_Normal;
+  vec3 binormalIn = p3d_Binormal;
+  vec3 tangentIn  = p3d_Tangent;
+
+  // Each instance is rotated, uniformly scaled, and then moved into place.
+  if (isInstanced.x == 1) {
+    vertex.xyz = rotateByInstance(vertex.xyz * instanceOffset.w) + instanceOffset.xyz;
+    normal     = rotateByInstance(normal);
+    binormalIn = rotateByInstance(binormalIn);
+    tangentIn  = rotateByInstance(tangentIn);
+  }
+
   vertexColor    = p3d_Color;
-  vertexPosition = p3d_ModelViewMatrix * p3d_Vertex;
+  vertexPosition = p3d_ModelViewMatrix * vertex;
 
-  vertexNormal = normalize(p3d_NormalMatrix * p3d_Normal);
-  binormal     = normalize(p3d_NormalMatrix * p3d_Binormal);
-  tangent      = normalize(p3d_NormalMatrix * p3d_Tangent);
+  vertexNormal = normalize(p3d_NormalMatrix * normal);
+  binormal     = normalize(p3d_NormalMatrix * binormalIn);
+  tangent      = normalize(p3d_NormalMatrix * tangentIn);
 
   normalCoord   = p3d_MultiTexCoord0;
   diffuseCoord  = p3d_MultiTexCoord1;
@@ -76,4 +95,9 @@ void main() {
   }
 
   gl_Position = p3d_ProjectionMatrix * vertexPosition;
+
+  // Cuts away everything under the water's surface.
+#ifdef PLANAR_REFLECTION
+  gl_ClipDistance[0] = dot(vertexPosition, p3d_ClipPlane[0]);
+#endif
 }
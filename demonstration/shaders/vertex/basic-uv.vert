@@ -0,0 +1,19 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+uniform mat4 p3d_ModelViewProjectionMatrix;
+
+in vec4 p3d_Vertex;
+in vec2 p3d_MultiTexCoord0;
+
+out vec2 texCoord;
+
+void main()
+{
+  texCoord    = p3d_MultiTexCoord0;
+  gl_Position = p3d_ModelViewProjectionMatrix * p3d_Vertex;
+}
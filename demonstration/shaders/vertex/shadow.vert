@@ -0,0 +1,27 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+#pragma include "shaders/include/instancing.glsl"
+
+uniform mat4 p3d_ModelViewProjectionMatrix;
+
+in vec4 p3d_Vertex;
+
+in vec2 p3d_MultiTexCoord1;
+
+out vec2 diffuseCoord;
+
+void main() {
+  vec4 vertex = p3d_Vertex;
+  if (isInstanced.x == 1) {
+    vertex.xyz = rotateByInstance(vertex.xyz * instanceOffset.w) + instanceOffset.xyz;
+  }
+
+  diffuseCoord = p3d_MultiTexCoord1;
+
+  gl_Position = p3d_ModelViewProjectionMatrix * vertex;
+}
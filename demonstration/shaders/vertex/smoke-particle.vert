@@ -0,0 +1,78 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+#define NUMBER_OF_LIGHTS 4
+
+uniform mat4 p3d_ModelViewMatrix;
+uniform mat4 p3d_ProjectionMatrix;
+
+uniform struct p3d_LightSourceParameters
+  { vec4 color
+
+  ; vec4 ambient
+  ; vec4 diffuse
+  ; vec4 specular
+
+  ; vec4 position
+
+  ; vec3  spotDirection
+  ; float spotExponent
+  ; float spotCutoff
+  ; float spotCosCutoff
+
+  ; float constantAttenuation
+  ; float linearAttenuation
+  ; float quadraticAttenuation
+
+  ; vec3 attenuation
+
+  ; sampler2DShadow shadowMap
+
+  ; mat4 shadowViewMatrix
+  ;
+  } p3d_LightSource[NUMBER_OF_LIGHTS];
+
+in vec2 p3d_MultiTexCoord0;
+
+// One per particle: the position with the size in w and then the color.
+in vec4 offset;
+in vec4 particleColor;
+
+out vec4 vertexPosition;
+out vec4 vertexColor;
+
+out vec3 vertexNormal;
+out vec3 binormal;
+out vec3 tangent;
+
+out vec2 normalCoord;
+out vec2 diffuseCoord;
+
+out vec4 vertexInShadowSpaces[NUMBER_OF_LIGHTS];
+
+void main() {
+  // Expand the corner in view space so the quad always faces the camera.
+  // The view space is Z up and Y forward so the quad spans X and Z.
+  vec2 corner = (p3d_MultiTexCoord0 - 0.5) * offset.w;
+
+  vertexColor     = particleColor;
+  vertexPosition  = p3d_ModelViewMatrix * vec4(offset.xyz, 1.0);
+  vertexPosition += vec4(corner.x, 0.0, corner.y, 0.0);
+
+  vertexNormal = vec3(0.0, -1.0, 0.0);
+  binormal     = vec3(0.0,  0.0, 1.0);
+  tangent      = vec3(1.0,  0.0, 0.0);
+
+  normalCoord  = p3d_MultiTexCoord0;
+  diffuseCoord = p3d_MultiTexCoord0;
+
+  for (int i = 0; i < p3d_LightSource.length(); ++i) {
+    vertexInShadowSpaces[i] = p3d_LightSource[i].shadowViewMatrix * vertexPosition;
+  }
+
+  gl_Position = p3d_ProjectionMatrix * vertexPosition;
+}
@@ -0,0 +1,58 @@
+/*
+  (C) 2020 David Lettier
+  lettier.com
+*/
+
+#version 150
+
+#pragma include "shaders/include/instancing.glsl"
+
+uniform mat4 p3d_ModelMatrix;
+uniform mat4 p3d_ModelViewMatrix;
+uniform mat4 p3d_ProjectionMatrix;
+
+uniform mat4 motionMat;
+uniform mat4 previousWorldViewMat;
+
+uniform vec2 isSkinned;
+
+in vec4 p3d_Vertex;
+in vec4 p3d_Color;
+
+// Where the animated models' joints had this vertex last frame.
+in vec3 previousVertex;
+
+in vec2 p3d_MultiTexCoord1;
+
+out vec4 vertexPosition;
+out vec4 vertexColor;
+
+out vec4 currentClipPosition;
+out vec4 previousClipPosition;
+
+out vec2 diffuseCoord;
+
+void main() {
+  vec4 vertex = p3d_Vertex;
+  if (isInstanced.x == 1) {
+    vertex.xyz = rotateByInstance(vertex.xyz * instanceOffset.w) + instanceOffset.xyz;
+  }
+
+  vertexColor    = p3d_Color;
+  vertexPosition = p3d_ModelViewMatrix * vertex;
+
+  diffuseCoord = p3d_MultiTexCoord1;
+
+  vec4 previous = vertex;
+  if (isSkinned.x == 1) {
+    previous = vec4(previousVertex, 1);
+  }
+
+  // The motion matrix takes this frame's world position to where it was last frame.
+  vec4 previousWorldPosition = motionMat * p3d_ModelMatrix * previous;
+
+  currentClipPosition  = p3d_ProjectionMatrix * vertexPosition;
+  previousClipPosition = p3d_ProjectionMatrix * previousWorldViewMat * previousWorldPosition;
+
+  gl_Position = currentClipPosition;
+}
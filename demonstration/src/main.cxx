@@ -10,10 +10,31 @@
 #include <chrono>
 #include <thread>
 #include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <tuple>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "pandaFramework.h" // Panda3D 1.10.9
 #include "renderBuffer.h"
 #include "load_prc_file.h"
+#include "configVariableInt.h"
+#include "configVariableBool.h"
+#include "configVariableDouble.h"
+#include "configVariableString.h"
 #include "pStatClient.h"
 #include "pandaSystem.h"
 #include "mouseButton.h"
@@ -25,12 +46,21 @@
 #include "pointLight.h"
 #include "spotlight.h"
 #include "shader.h"
+#include "colorWriteAttrib.h"
+#include "lightAttrib.h"
 #include "nodePathCollection.h"
 #include "auto_bind.h"
 #include "animControlCollection.h"
 #include "cardMaker.h"
 #include "fontPool.h"
 #include "texturePool.h"
+#include "modelPool.h"
+#include "loader.h"
+#include "config_putil.h"
+#include "virtualFileSystem.h"
+#include "multifile.h"
+#include "executionEnvironment.h"
+#include "pnmImage.h"
 #include "particleSystemManager.h"
 #include "physicsManager.h"
 #include "spriteParticleRenderer.h"
@@ -43,6 +73,19 @@
 #include "linearJitterForce.h"
 #include "linearCylinderVortexForce.h"
 #include "linearEulerIntegrator.h"
+#include "geomVertexArrayFormat.h"
+#include "geomVertexFormat.h"
+#include "geomVertexData.h"
+#include "geomVertexWriter.h"
+#include "geomVertexReader.h"
+#include "geomTriangles.h"
+#include "geomNode.h"
+#include "omniBoundingVolume.h"
+#include "boundingBox.h"
+#include "lightLensNode.h"
+#include "lodNode.h"
+#include "planeNode.h"
+#include "cullFaceAttrib.h"
 #include "audioManager.h"
 #include "audioSound.h"
 
@@ -54,6 +97,7 @@ struct FramebufferTexture
   ; PT(Camera) camera
   ; NodePath cameraNP
   ; NodePath shaderNP
+  ; int sizeDivisor
   ;
   };
 
@@ -69,7 +113,216 @@ struct FramebufferTextureArguments
   ; bool setSrgbColor
   ; bool setRgbColor
   ; bool useScene
+  ; int sizeDivisor
   ; std::string name
+  ; std::vector<FramebufferTexture>* framebufferTextures
+  ;
+  };
+
+struct MotionTrackedNode
+  { NodePath nodePath
+  ; LMatrix4 previousWorldMat
+  ; std::vector<PT(GeomNode)> skinnedGeomNodes
+  ;
+  };
+
+struct SmokeParticles
+  { std::vector<float> positionX
+  ; std::vector<float> positionY
+  ; std::vector<float> positionZ
+  ; std::vector<float> velocityX
+  ; std::vector<float> velocityY
+  ; std::vector<float> velocityZ
+  ; std::vector<float> age
+  ; std::vector<float> lifespan
+  ; std::vector<unsigned int> depthKeys
+  ; std::vector<unsigned int> depthKeysSwap
+  ; std::vector<unsigned int> order
+  ; std::vector<unsigned int> orderSwap
+  ; std::vector<unsigned int> seeds
+  ; int poolSize
+  ; int litterSize
+  ; int count
+  ; double birthTime
+  ;
+  };
+
+struct SmokeParticleWorkers
+  { std::vector<std::thread> threads
+  ; std::mutex mutex
+  ; std::condition_variable startCondition
+  ; std::condition_variable doneCondition
+  ; std::function<void(int, int)> job
+  ; int generation
+  ; int remaining
+  ; bool stop
+  ;
+  };
+
+struct BakedTexture
+  { std::string sourcePath
+  ; long long sourceSize
+  ; long long sourceTimestamp
+  ; std::string bakedPath
+  ;
+  };
+
+struct MappedArchiveBuffer : public std::streambuf
+  { MappedArchiveBuffer
+      ( char* data
+      , size_t size
+      ) {
+      setg(data, data, data + size);
+      }
+
+    pos_type seekoff
+      ( off_type offset
+      , std::ios_base::seekdir direction
+      , std::ios_base::openmode which
+      ) override {
+      char* position =
+          direction == std::ios_base::beg ? eback()
+        : direction == std::ios_base::cur ? gptr()
+        :                                   egptr();
+
+      position += offset;
+
+      if (position < eback() || position > egptr()) { return pos_type(off_type(-1)); }
+
+      setg(eback(), position, egptr());
+
+      return pos_type(position - eback());
+      }
+
+    pos_type seekpos
+      ( pos_type position
+      , std::ios_base::openmode which
+      ) override {
+      return seekoff(off_type(position), std::ios_base::beg, which);
+      }
+  };
+
+struct AssetArchive
+  { void* data
+  ; size_t size
+  ; MappedArchiveBuffer* buffer
+  ; std::istream* stream
+  ; PT(Multifile) multifile
+  ;
+  };
+
+struct FrameCommit
+  { std::vector<std::function<void()>> changes
+  ;
+  };
+
+struct SimulationFrame
+  { float delta
+  ; LVecBase3f cameraPosition
+  ; LVecBase3f cameraDirection
+  ; LVecBase3f listenerPosition
+  ; LVecBase3f listenerForward
+  ; LVecBase3f listenerUp
+  ; std::vector<float> smokeInstances
+  ; int smokeInstanceCount
+  ;
+  };
+
+struct Simulation
+  { SimulationFrame frames[2]
+  ; int front
+  ; SmokeParticles* smokeParticles
+  ; SmokeParticleWorkers* smokeParticleWorkers
+  ; PT(AsyncTaskChain) taskChain
+  ; PT(AsyncTask) task
+  ;
+  };
+
+struct FramePacer
+  { std::chrono::steady_clock::duration interval
+  ; std::chrono::steady_clock::time_point deadline
+  ; bool lowLatency
+  ; long frames
+  ; double jitterTotal
+  ; double jitterMax
+  ; long lateFrames
+  ; long long waited
+  ;
+  };
+
+// Written by one thread and read by any other without a lock.
+// Each sample is published by bumping the count after it's stored.
+struct FrameTimes
+  { std::vector<std::atomic<long long>> samples
+  ; std::atomic<long long> count
+  ;
+  };
+
+struct RenderSuspension
+  { bool suspended
+  ; std::vector<PT(GraphicsOutput)> outputs
+  ;
+  };
+
+struct ResizeController
+  { int xSize
+  ; int ySize
+  ; long long changedAt
+  ; bool pending
+  ;
+  };
+
+struct QualityPreset
+  { std::string name
+  ; int ssaoSamples
+  ; int ssaoNoise
+  ; int shadowSize
+  ; int reflectionBlurSize
+  ; int screenSpaceSteps
+  ; float screenSpaceResolution
+  ; int bloomLevels
+  ; int depthOfFieldBlurSize
+  ;
+  };
+
+struct EffectCost
+  { std::string name
+  ; LVecBase2f* enabled
+  ; double frameOn
+  ; double frameOff
+  ; double updateOn
+  ; double updateOff
+  ;
+  };
+
+struct FrameTimeStats
+  { double p50
+  ; double p95
+  ; double p99
+  ; double max
+  ; long long count
+  ;
+  };
+
+struct CostMatrix
+  { bool running
+  ; int effect
+  ; bool effectOn
+  ; int frames
+  ; FrameTimes frameTimes
+  ; FrameTimes updateTimes
+  ; std::vector<EffectCost> effects
+  ; std::vector<LVecBase2f> defaults
+  ;
+  };
+
+struct FrameBudgetGovernor
+  { bool enabled
+  ; double budget
+  ; std::vector<std::tuple<std::string, LVecBase2f*>> order
+  ; std::vector<int> shed
+  ; FrameTimes busyTimes
+  ; long long changedAt
   ;
   };
 
@@ -100,12 +353,50 @@ float animateLights
 PT(Shader) loadShader
   ( std::string vert
   , std::string frag
+  , std::string defines = ""
+  );
+QualityPreset loadQualityPreset
+  (
+  );
+void setUpCostMatrix
+  ( CostMatrix& matrix
+  , std::vector<std::tuple<std::string, LVecBase2f*>> effects
+  );
+bool stepCostMatrix
+  ( CostMatrix& matrix
+  , long long frameMicroseconds
+  , long long updateMicroseconds
+  );
+void printCostMatrix
+  ( CostMatrix& matrix
+  );
+
+int autotuneQuality
+  ( std::string executable
+  );
+double runAutotuneTrial
+  ( std::string executable
+  , QualityPreset candidate
   );
 
 FramebufferTexture generateFramebufferTexture
   ( FramebufferTextureArguments framebufferTextureArguments
   );
 
+void setUpResizeController
+  ( ResizeController& controller
+  , PT(GraphicsOutput) graphicsOutput
+  );
+bool updateResizeController
+  ( ResizeController& controller
+  , PT(GraphicsOutput) graphicsOutput
+  , long long now
+  );
+void resizeFramebufferTextures
+  ( PT(GraphicsOutput) graphicsOutput
+  , std::vector<FramebufferTexture>& framebufferTextures
+  );
+
 PTA_LVecBase3f generateSsaoSamples
   ( int numberOfSamples
   );
@@ -124,7 +415,7 @@ void hideBuffer
   ( NodePath render2d
   );
 
-int microsecondsSinceEpoch
+long long monotonicMicroseconds
   (
   );
 
@@ -151,8 +442,7 @@ void setSoundState
   );
 
 void updateAudoManager
-  ( NodePath sceneRootNP
-  , NodePath cameraNP
+  ( const SimulationFrame& frame
   );
 
 LVecBase3f calculateCameraPosition
@@ -173,14 +463,253 @@ LVecBase3f calculateCameraLookAt
 NodePath setUpParticles
   ( NodePath render
   , PT(Texture) smokeTexture
+  , ParticleSystemManager& particleSystemManager
+  , PhysicsManager& physicsManager
+  , int poolSize
+  , int litterSize
+  );
+
+NodePath setUpSmokeParticles
+  ( NodePath render
+  , PT(Texture) smokeTexture
+  );
+void resetSmokeParticles
+  ( SmokeParticles& particles
+  , int poolSize
+  , int litterSize
+  , int numberOfWorkers
+  );
+void updateSmokeParticles
+  ( NodePath smokeNP
+  , const SimulationFrame& frame
+  );
+void emitSmokeParticles
+  ( SmokeParticles& particles
+  , float delta
+  );
+void simulateSmokeParticles
+  ( SmokeParticles& particles
+  , SmokeParticleWorkers& workers
+  , float delta
+  , LVecBase3f cameraPosition
+  , LVecBase3f cameraDirection
+  , float* instanceData
+  );
+void simulateSmokeParticleRange
+  ( SmokeParticles& particles
+  , int begin
+  , int end
+  , float delta
+  , LVecBase3f cameraPosition
+  , LVecBase3f cameraDirection
+  , unsigned int& seed
+  );
+void sortSmokeParticles
+  ( SmokeParticles& particles
+  );
+void writeSmokeParticleRange
+  ( SmokeParticles& particles
+  , int begin
+  , int end
+  , float* instanceData
+  );
+float randomSmokeJitter
+  ( unsigned int& seed
+  );
+void benchmarkSmokeParticles
+  ( PT(Texture) smokeTexture
+  );
+
+void startSmokeParticleWorkers
+  ( SmokeParticleWorkers& workers
+  , int numberOfWorkers
+  );
+void runSmokeParticleWorkers
+  ( SmokeParticleWorkers& workers
+  , std::function<void(int, int)> job
+  );
+void stopSmokeParticleWorkers
+  ( SmokeParticleWorkers& workers
+  );
+
+void setUpSimulation
+  ( Simulation& simulation
+  , SmokeParticles& smokeParticles
+  , SmokeParticleWorkers& smokeParticleWorkers
+  );
+void launchSimulation
+  ( Simulation& simulation
+  , float delta
+  , NodePath sceneRootNP
+  , NodePath smokeNP
+  , NodePath cameraNP
+  );
+void stepSimulation
+  ( Simulation& simulation
+  );
+bool syncSimulation
+  ( Simulation& simulation
+  );
+
+void stageInitialState
+  ( FrameCommit& commit
+  , PT(Camera) camera
+  , NodePath shaderNP
+  );
+void stageTagState
+  ( FrameCommit& commit
+  , PT(Camera) camera
+  , std::string tag
+  , CPT(RenderState) state
+  );
+void stageChange
+  ( FrameCommit& commit
+  , std::function<void()> change
+  );
+void commitFrame
+  ( FrameCommit& commit
+  , PT(GraphicsEngine) graphicsEngine
+  );
+
+void setUpFramePacer
+  ( FramePacer& pacer
+  , int targetRate
+  , bool lowLatency
+  );
+void paceFrame
+  ( FramePacer& pacer
+  , bool idle
+  );
+void reportFramePacer
+  ( FramePacer& pacer
+  );
+
+void setUpFrameBudgetGovernor
+  ( FrameBudgetGovernor& governor
+  , bool enabled
+  , double budget
+  , std::string shedOrder
+  , std::vector<std::tuple<std::string, LVecBase2f*>> effects
+  );
+std::string governFrameBudget
+  ( FrameBudgetGovernor& governor
+  , long long busyMicroseconds
+  , long long now
+  );
+
+void resetFrameTimes
+  ( FrameTimes& times
+  , int size
+  );
+void recordFrameTime
+  ( FrameTimes& times
+  , long long microseconds
+  );
+FrameTimeStats calculateFrameTimeStats
+  ( const FrameTimes& times
+  );
+std::string formatFrameTimeStats
+  ( FrameTimeStats stats
+  );
+
+void suspendRendering
+  ( RenderSuspension& suspension
+  , PT(GraphicsEngine) graphicsEngine
+  , PT(GraphicsOutput) graphicsOutput
+  );
+void resumeRendering
+  ( RenderSuspension& suspension
   );
 
 void squashGeometry
   ( NodePath environmentNP
   );
+void instanceRepeatedGeometry
+  ( NodePath environmentNP
+  , NodePath instancesNP
+  , NodePathCollection propCollection
+  );
+std::string getGeometrySignature
+  ( NodePath propNP
+  , NodePath environmentNP
+  );
+void setUpInstancedGeometry
+  ( NodePath environmentNP
+  );
+void addLevelsOfDetail
+  ( NodePath clusterNP
+  );
+PT(Geom) simplifyGeometry
+  ( CPT(Geom) geom
+  , PN_stdfloat cellSize
+  );
+void setUpLevelsOfDetail
+  ( NodePath environmentNP
+  , PT(Lens) lens
+  , int windowHeight
+  );
+void setUpShadowCasters
+  ( NodePath render
+  , PT(Shader) shadowShader
+  , NodePath cameraNP
+  );
+bool calculateScreenBounds
+  ( LPoint3 boundsMin
+  , LPoint3 boundsMax
+  , LMatrix4 toCamera
+  , PT(Lens) lens
+  , LVecBase4& dimensions
+  );
+Filename getBakedSceneFilename
+  ( Filename sceneFilename
+  );
+std::string findBakedScene
+  ( std::string scenePath
+  );
+int bakeScene
+  ( std::string scenePath
+  );
+int bakeTextures
+  ( std::vector<std::string> directories
+  , std::string manifestPath
+  );
+PT(Texture) bakeTexture
+  ( PT(Texture) texture
+  , std::string name
+  , std::string& format
+  );
+PT(Texture) compressBc5Texture
+  ( PT(Texture) texture
+  );
+void compressBc4Block
+  ( unsigned char values[16]
+  , unsigned char* block
+  );
+std::vector<BakedTexture> loadTextureManifest
+  ( std::string manifestPath
+  );
+void preloadBakedTextures
+  ( std::vector<BakedTexture> bakedTextures
+  );
+unsigned long long hashBytes
+  ( const unsigned char* bytes
+  , size_t size
+  , unsigned long long hash
+  );
+int packAssets
+  ( std::vector<std::string> paths
+  , std::string archivePath
+  );
+bool mountAssetArchive
+  ( AssetArchive& archive
+  , std::string archivePath
+  );
+void unmountAssetArchive
+  ( AssetArchive& archive
+  );
 
 double microsecondToSecond
-  ( int m
+  ( long long m
   );
 
 double toRadians
@@ -199,12 +728,34 @@ void setTextureToNearestAndClamp
   ( PT(Texture) texture
   );
 
+void setTextureToLinearAndClamp
+  ( PT(Texture) texture
+  );
+
+PT(Texture) generateLookupTableTexture
+  ( PT(Texture) lookupTableStrip
+  );
+void blendLookupTableTextures
+  ( PT(Texture) a
+  , PT(Texture) b
+  , PT(Texture) result
+  , float amount
+  );
+
 LColor mixColor
   ( LColor a
   , LColor b
   , float amount
   );
 
+void trackSkinnedVertices
+  ( MotionTrackedNode& motionTrackedNode
+  );
+void updateMotionTrackedNodes
+  ( NodePath render
+  , std::vector<MotionTrackedNode>& motionTrackedNodes
+  );
+
 // END FUNCTIONS
 
 // GLOBALS
@@ -219,10 +770,104 @@ const LVecBase2f GAMMA_SHADER_INPUT = LVecBase2f(GAMMA, GAMMA_REC);
 const int BACKGROUND_RENDER_SORT_ORDER = 10;
 const int UNSORTED_RENDER_SORT_ORDER   = 50;
 
-const int SSAO_SAMPLES = 8;
-const int SSAO_NOISE   = 4;
+// The quality-preset PRC variable picks one of these by name.
+// Any of the quality-* PRC variables set on their own override the preset's value.
+// The SSAO noise is laid out in a square so it has to be a square number.
+
+const std::vector<QualityPreset> QUALITY_PRESETS =
+  //  name      samples noise shadow reflection steps resolution bloom focus
+  { { "low"   ,  4,      4,     512,  4,         3,    0.2,       3,    2 }
+  , { "medium",  8,      4,    1024,  6,         4,    0.25,      4,    3 }
+  , { "high"  ,  8,      4,    2048,  8,         5,    0.3,       5,    4 }
+  , { "ultra" , 16,     16,    4096,  8,         8,    0.5,       5,    6 }
+  };
+const std::string DEFAULT_QUALITY_PRESET = "high";
+
+// The autotuner writes what it picks here and every later run loads it after the main PRC file.
+const std::string AUTOTUNE_PRC_PATH      = "panda3d-prc-file-autotune.prc";
+const int         AUTOTUNE_WARMUP_FRAMES = 60;
+const int         AUTOTUNE_TRIAL_FRAMES  = 300;
+
+// Every effect is measured on then off along the same orbit, after a short warm up each time.
+const int COST_MATRIX_WARMUP_FRAMES = 30;
+const int COST_MATRIX_TRIAL_FRAMES  = 120;
+
+const std::string SCENE_PATH = "eggs/mill-scene/mill-scene.bam";
+
+const int   SCENE_CLUSTER_GRID_SIZE = 4;
+const float SCENE_CLUSTER_MAX_CELLS = 2;
+
+// Each coarser level snaps its vertices to a grid with cells this size.
+// A level is drawn once its cells shrink below this many pixels on screen.
+const std::vector<float> SCENE_LOD_CELL_SIZES =
+  { 0.02
+  , 0.06
+  };
+const float SCENE_LOD_PIXEL_ERROR = 2;
+
+// The water passes are scissored to the water's rectangle on screen plus this many pixels,
+// which covers the hole filling in reflection-color and the reflection blur.
+const int WATER_SCISSOR_MARGIN = 32;
 
-const int SHADOW_SIZE = 2048;
+const std::vector<std::string> TEXTURE_DIRECTORIES =
+  { "images"
+  , "eggs/mill-scene/tex"
+  };
+const std::string TEXTURE_MANIFEST_PATH = "texture-manifest.txt";
+
+const std::vector<std::string> ASSET_PATHS =
+  { "fonts"
+  , "sounds"
+  , "images"
+  , "eggs"
+  , "shaders"
+  , TEXTURE_MANIFEST_PATH
+  };
+const std::string ASSET_ARCHIVE_PATH      = "assets.mf";
+const int         ASSET_ARCHIVE_ALIGNMENT = 4096;
+
+// The last stretch of a frame's wait is spun out since sleeps can overshoot by a millisecond or more.
+const std::chrono::microseconds FRAME_PACER_SPIN_TIME          = std::chrono::microseconds(2000);
+const std::chrono::microseconds FRAME_PACER_MINIMIZED_INTERVAL = std::chrono::microseconds(100000);
+
+// Enough for about a minute at 60 frames per second.
+const int FRAME_TIME_SAMPLES = 4096;
+
+// The governor looks at the last half second of frames and turns off the next optional effect when
+// they run over budget. An effect only comes back once the frames have been well under budget for a while.
+const int       FRAME_BUDGET_WINDOW               = 30;
+const double    FRAME_BUDGET_RESTORE_FACTOR       = 0.7;
+const long long FRAME_BUDGET_RESTORE_MICROSECONDS = 3000000;
+
+// The buffers are only resized once the window has kept the same size for this long.
+const long long RESIZE_DEBOUNCE_MICROSECONDS = 250000;
+
+const int DEPTH_OF_FIELD_TILE_SIZE = 16;
+const int VELOCITY_TILE_SIZE       = 16;
+
+// The smoke keeps the emitter and forces of the original Panda particle system
+// but with a pool large enough for tens of thousands of particles.
+
+const int   SMOKE_PARTICLE_POOL_SIZE          = 32768;
+const int   SMOKE_PARTICLE_LITTER_SIZE        = 256;
+const float SMOKE_PARTICLE_BIRTH_RATE         = 0.01;
+const float SMOKE_PARTICLE_LIFESPAN_BASE      = 0.1;
+const float SMOKE_PARTICLE_LIFESPAN_SPREAD    = 3.0;
+const float SMOKE_PARTICLE_LAUNCH_SPEED       = 0.1;
+const float SMOKE_PARTICLE_OFFSET_SPEED       = 2.0;
+const float SMOKE_PARTICLE_TERMINAL_VELOCITY  = 400.0;
+const float SMOKE_PARTICLE_FORCE_X            = 3.0;
+const float SMOKE_PARTICLE_FORCE_Y            = -2.0;
+const float SMOKE_PARTICLE_JITTER             = 2.0;
+const float SMOKE_PARTICLE_VORTEX_RADIUS      = 10.0;
+const float SMOKE_PARTICLE_VORTEX_LENGTH      = 1.0;
+const float SMOKE_PARTICLE_VORTEX_COEFFICIENT = 4.0;
+const float SMOKE_PARTICLE_SIZE               = 0.25;
+const float SMOKE_PARTICLE_ALPHA              = 0.05;
+const int   SMOKE_PARTICLE_INSTANCE_FLOATS    = 8;
+const int   SMOKE_PARTICLE_MAX_WORKERS        = 8;
+
+const LColor SMOKE_PARTICLE_END_COLOR = LColor(0.039, 0.078, 0.156, 1.0);
 
 LVecBase4f sunlightColor0 =
   LVecBase4f
@@ -271,9 +916,9 @@ PT(AsyncTaskManager) taskManager = AsyncTaskManager::get_global_ptr();
 
 PT(AudioManager) audioManager = AudioManager::create_AudioManager();
 
-ParticleSystemManager particleSystemManager = ParticleSystemManager();
+SmokeParticleWorkers smokeParticleWorkers;
 
-PhysicsManager physicsManager = PhysicsManager();
+QualityPreset quality;
 
 // END GLOBALS
 
@@ -369,6 +1014,7 @@ int main
   LVecBase2f posterizeEnabled           = makeEnabledVec(0);
   LVecBase2f pixelizeEnabled            = makeEnabledVec(0);
   LVecBase2f chromaticAberrationEnabled = makeEnabledVec(1);
+  LVecBase2f deferredLightingEnabled    = makeEnabledVec(1);
 
   LVecBase4 rgba8  = ( 8,  8,  8,  8);
   LVecBase4 rgba16 = (16, 16, 16, 16);
@@ -376,6 +1022,106 @@ int main
 
   load_prc_file("panda3d-prc-file.prc");
 
+  bool autotuneTrial = false;
+  bool costMatrix    = false;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string argument = std::string(argv[i]);
+
+    if (argument == "--autotune") {
+      return autotuneQuality(argv[0]);
+    }
+
+    // A trial draws a fixed orbit of the scene with the given settings, as fast as it can.
+    if (argument == "--autotune-trial" && i + 4 < argc) {
+      autotuneTrial = true;
+      load_prc_file_data
+        ( "autotune-trial"
+        , "quality-preset "                  + std::string(argv[i + 1]) + "\n"
+        + "quality-shadow-size "             + std::string(argv[i + 2]) + "\n"
+        + "quality-ssao-samples "            + std::string(argv[i + 3]) + "\n"
+        + "quality-screen-space-resolution " + std::string(argv[i + 4]) + "\n"
+        + "frame-rate-target 0\n"
+        + "suspend-when-unfocused #f\n"
+        + "frame-budget-governor #f\n"
+        );
+    }
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) == "--cost-matrix") {
+      costMatrix = true;
+      load_prc_file_data
+        ( "cost-matrix"
+        , "frame-rate-target 0\n"
+          "suspend-when-unfocused #f\n"
+          "frame-budget-governor #f\n"
+        );
+    }
+  }
+
+  if (!autotuneTrial && Filename(AUTOTUNE_PRC_PATH).exists()) {
+    load_prc_file(AUTOTUNE_PRC_PATH);
+  }
+
+  quality = loadQualityPreset();
+
+  ConfigVariableInt  frameRateTarget
+    ( "frame-rate-target"
+    , 60
+    , "The number of frames to draw per second or zero for as many as possible."
+    );
+  ConfigVariableBool framePacerLowLatency
+    ( "frame-pacer-low-latency"
+    , false
+    , "Wait out the frame before reading the input rather than before drawing."
+    );
+  ConfigVariableBool framePacerReport
+    ( "frame-pacer-report"
+    , false
+    , "Print the frame pacing stats on exit even when the frames aren't paced."
+    );
+  ConfigVariableBool suspendWhenUnfocused
+    ( "suspend-when-unfocused"
+    , true
+    , "Stop drawing the offscreen buffers while the window doesn't have the focus."
+    );
+  ConfigVariableString waterReflectionMode
+    ( "water-reflection"
+    , "screen-space"
+    , "How the water reflects the scene, either screen-space or planar."
+    );
+  ConfigVariableBool   frameBudgetGovernorEnabled
+    ( "frame-budget-governor"
+    , false
+    , "Turn off optional effects while the frames run over budget."
+    );
+  ConfigVariableDouble frameBudget
+    ( "frame-budget"
+    , 0
+    , "The milliseconds each frame may take or zero to use the frame rate target."
+    );
+  ConfigVariableString frameBudgetShedOrder
+    ( "frame-budget-shed-order"
+    , "Film Grain, Chromatic Aberration, Painterly, Sharpen"
+    , "The optional effects to turn off when over budget, first to last."
+    );
+
+#if defined(BAKE_SCENE)
+  int sceneBaked    = bakeScene(SCENE_PATH);
+  int texturesBaked = bakeTextures(TEXTURE_DIRECTORIES, TEXTURE_MANIFEST_PATH);
+  int assetsPacked  = packAssets(ASSET_PATHS, ASSET_ARCHIVE_PATH);
+  return std::max(sceneBaked, std::max(texturesBaked, assetsPacked));
+#endif
+
+  // When there's an archive, every asset below is read out of it instead of the loose files.
+  AssetArchive assetArchive;
+  mountAssetArchive(assetArchive, ASSET_ARCHIVE_PATH);
+
+  // Every later load of a baked texture's source, including the ones inside the scene files,
+  // finds the compressed and mipmapped version already in the pool.
+  preloadBakedTextures(loadTextureManifest(TEXTURE_MANIFEST_PATH));
+
   PT(TextFont) font = FontPool::load_font("fonts/font.ttf");
 
   std::vector<PT(AudioSound)> sounds =
@@ -394,8 +1140,33 @@ int main
   PT(Texture) colorNoiseTexture        = TexturePool::load_texture("images/color-noise.png");
 
   setTextureToNearestAndClamp(colorLookupTableTextureN);
-  setTextureToNearestAndClamp(colorLookupTableTexture0);
-  setTextureToNearestAndClamp(colorLookupTableTexture1);
+
+  int numberOfSmokeParticleWorkers =
+    std::max
+      ( 1
+      , std::min
+          ( SMOKE_PARTICLE_MAX_WORKERS
+          , (int) std::thread::hardware_concurrency() - 1
+          )
+      );
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) == "--benchmark-particles") {
+      startSmokeParticleWorkers(smokeParticleWorkers, numberOfSmokeParticleWorkers);
+      benchmarkSmokeParticles(smokeTexture);
+      stopSmokeParticleWorkers(smokeParticleWorkers);
+      return 0;
+    }
+  }
+
+  // The strips become 3D textures so the hardware does the trilinear filtering.
+  // The two are blended on the CPU into the third whenever the sun moves.
+  PT(Texture) colorLookupTableTexture3d0 = generateLookupTableTexture(colorLookupTableTexture0);
+  PT(Texture) colorLookupTableTexture3d1 = generateLookupTableTexture(colorLookupTableTexture1);
+  PT(Texture) colorLookupTableTexture3d  = generateLookupTableTexture(colorLookupTableTexture0);
+  float       colorLookupTableMix        = -1;
+
+  setTextureToLinearAndClamp(colorLookupTableTexture3d);
 
   PandaFramework framework;
   framework.open_framework(argc, argv);
@@ -407,6 +1178,9 @@ int main
   PT(GraphicsStateGuardian)   graphicsStateGuardian = graphicsOutput->get_gsg();
   PT(GraphicsEngine)          graphicsEngine        = graphicsStateGuardian->get_engine();
 
+  // Changes the cull and draw threads could be reading wait here for the frame boundary.
+  FrameCommit frameCommit;
+
   window->enable_keyboard();
 
   PT(DisplayRegion) displayRegion3d = window->get_display_region_3d();
@@ -453,11 +1227,16 @@ int main
   NodePath sceneRootNP      = NodePath(sceneRootPN);
   sceneRootNP.reparent_to(render);
 
+  // Squashing the scene gives the same result every run so the bake tool does it ahead of time.
+  // Fall back to squashing here when the baked scene is missing or older than the source.
+
+  std::string bakedScenePath = findBakedScene(SCENE_PATH);
+
   NodePath environmentNP =
     window
       ->load_model
         ( framework.get_models()
-        , "eggs/mill-scene/mill-scene.bam"
+        , bakedScenePath.empty() ? SCENE_PATH : bakedScenePath
         );
   environmentNP.reparent_to(sceneRootNP);
   NodePath shuttersNP =
@@ -485,9 +1264,28 @@ int main
   NodePath wheelNP   = environmentNP.find("**/wheel-lp");
   NodePath waterNP   = environmentNP.find("**/water-lp");
 
-  squashGeometry(environmentNP);
+  if (bakedScenePath.empty()) {
+    squashGeometry(environmentNP);
+  }
+
+  setUpInstancedGeometry(environmentNP);
+
+  int levelOfDetailHeight = graphicsOutput->get_y_size();
+  setUpLevelsOfDetail(environmentNP, mainLens, levelOfDetailHeight);
+
+  NodePath smokeNP = setUpSmokeParticles(render, smokeTexture);
 
-  NodePath smokeNP = setUpParticles(render, smokeTexture);
+  SmokeParticles smokeParticles;
+  resetSmokeParticles
+    ( smokeParticles
+    , SMOKE_PARTICLE_POOL_SIZE
+    , SMOKE_PARTICLE_LITTER_SIZE
+    , numberOfSmokeParticleWorkers
+    );
+  startSmokeParticleWorkers(smokeParticleWorkers, numberOfSmokeParticleWorkers);
+
+  Simulation simulation;
+  setUpSimulation(simulation, smokeParticles, smokeParticleWorkers);
 
   waterNP.set_transparency(TransparencyAttrib::M_dual);
   waterNP.set_bin("fixed", 0);
@@ -521,27 +1319,46 @@ int main
 
   PT(Shader) discardShader               = loadShader("discard", "discard");
   PT(Shader) baseShader                  = loadShader("base",    "base");
+  PT(Shader) planarReflectionSceneShader = loadShader("base",    "base", "#define PLANAR_REFLECTION\n");
+  PT(Shader) depthOnlyShader             = loadShader("base",    "depth-only");
+  PT(Shader) shadowShader                = loadShader("shadow",  "shadow");
+  PT(Shader) deferredLightingShader      = loadShader("basic",   "deferred-lighting");
   PT(Shader) geometryBufferShader0       = loadShader("base",    "geometry-buffer-0");
   PT(Shader) geometryBufferShader1       = loadShader("base",    "geometry-buffer-1");
-  PT(Shader) geometryBufferShader2       = loadShader("base",    "geometry-buffer-2");
+  PT(Shader) geometryBufferShader2       = loadShader("velocity", "geometry-buffer-2");
+  PT(Shader) smokeParticleShader         = loadShader("smoke-particle", "base");
   PT(Shader) foamShader                  = loadShader("basic",   "foam");
   PT(Shader) fogShader                   = loadShader("basic",   "fog");
   PT(Shader) boxBlurShader               = loadShader("basic",   "box-blur");
   PT(Shader) motionBlurShader            = loadShader("basic",   "motion-blur");
+  PT(Shader) velocityTilesShader         = loadShader("basic",   "velocity-tiles");
+  PT(Shader) velocityNeighborShader      = loadShader("basic",   "velocity-neighbor-tiles");
   PT(Shader) kuwaharaFilterShader        = loadShader("basic",   "kuwahara-filter");
-  PT(Shader) dilationShader              = loadShader("basic",   "dilation");
   PT(Shader) sharpenShader               = loadShader("basic",   "sharpen");
   PT(Shader) outlineShader               = loadShader("basic",   "outline");
-  PT(Shader) bloomShader                 = loadShader("basic",   "bloom");
-  PT(Shader) ssaoShader                  = loadShader("basic",   "ssao");
-  PT(Shader) screenSpaceRefractionShader = loadShader("basic",   "screen-space-refraction");
-  PT(Shader) screenSpaceReflectionShader = loadShader("basic",   "screen-space-reflection");
+  PT(Shader) bloomShader                 = loadShader("basic-uv", "bloom");
+  PT(Shader) bloomDownsampleShader       = loadShader("basic-uv", "bloom-downsample");
+  PT(Shader) bloomUpsampleShader         = loadShader("basic-uv", "bloom-upsample");
+  std::string ssaoDefines =
+      "#define NUM_SAMPLES " + std::to_string(quality.ssaoSamples) + "\n"
+    + "#define NUM_NOISE "   + std::to_string(quality.ssaoNoise)   + "\n";
+  std::string screenSpaceDefines =
+      "#define STEPS "      + std::to_string(quality.screenSpaceSteps)      + "\n"
+    + "#define RESOLUTION " + std::to_string(quality.screenSpaceResolution) + "\n";
+
+  PT(Shader) ssaoShader                  = loadShader("basic",   "ssao", ssaoDefines);
+  PT(Shader) screenSpaceRefractionShader = loadShader("basic",   "screen-space-refraction", screenSpaceDefines);
+  PT(Shader) screenSpaceReflectionShader = loadShader("basic",   "screen-space-reflection", screenSpaceDefines);
   PT(Shader) refractionShader            = loadShader("basic",   "refraction");
   PT(Shader) reflectionColorShader       = loadShader("basic",   "reflection-color");
   PT(Shader) reflectionShader            = loadShader("basic",   "reflection");
+  PT(Shader) planarReflectionShader      = loadShader("basic",   "planar-reflection");
   PT(Shader) baseCombineShader           = loadShader("basic",   "base-combine");
   PT(Shader) sceneCombineShader          = loadShader("basic",   "scene-combine");
   PT(Shader) depthOfFieldShader          = loadShader("basic",   "depth-of-field");
+  PT(Shader) depthOfFieldTilesShader     = loadShader("basic",   "depth-of-field-tiles");
+  PT(Shader) depthOfFieldNeighborShader  = loadShader("basic",   "depth-of-field-neighbor-tiles");
+  PT(Shader) depthOfFieldGatherShader    = loadShader("basic-uv", "depth-of-field-gather");
   PT(Shader) posterizeShader             = loadShader("basic",   "posterize");
   PT(Shader) pixelizeShader              = loadShader("basic",   "pixelize");
   PT(Shader) filmGrainShader             = loadShader("basic",   "film-grain");
@@ -549,6 +1366,13 @@ int main
   PT(Shader) gammaCorrectionShader       = loadShader("basic",   "gamma-correction");
   PT(Shader) chromaticAberrationShader   = loadShader("basic",   "chromatic-aberration");
 
+  setUpShadowCasters(render, shadowShader, cameraNP);
+
+  // Only the instanced props switch this on.
+  render.set_shader_input("isInstanced", LVecBase2f(0, 0));
+  // Only the animated models switch this on.
+  render.set_shader_input("isSkinned",   LVecBase2f(0, 0));
+
   NodePath mainCameraNP = NodePath("mainCamera");
   mainCameraNP.set_shader(discardShader);
   mainCamera->set_initial_state(mainCameraNP.get_state());
@@ -558,17 +1382,42 @@ int main
   isWaterNP.set_shader_input("flowTexture",        upFlowTexture);
   isWaterNP.set_shader_input("foamPatternTexture", foamPatternTexture);
 
+  // The smoke is drawn instanced so it brings its own vertex shader.
+
   NodePath isSmokeNP = NodePath("isSmoke");
-  isSmokeNP.set_shader_input("isSmoke",    LVecBase2f(1.0, 1.0));
+  isSmokeNP.set_shader(smokeParticleShader);
   isSmokeNP.set_shader_input("isParticle", LVecBase2f(1.0, 1.0));
 
   LMatrix4 currentViewWorldMat      = cameraNP.get_transform(render)->get_mat();
-  LMatrix4 previousViewWorldMat     = previousViewWorldMat;
+  LMatrix4 previousViewWorldMat     = currentViewWorldMat;
+
+  // These change as the camera and sun move.
+  // On render, unlike in a camera's initial state, they can change while the last frame is still being drawn.
+  render.set_shader_input("sunPosition",          LVecBase2f(sunlightP, 0));
+  render.set_shader_input("origin",               cameraNP.get_relative_point(render, environmentNP.get_pos()));
+  render.set_shader_input("nearFar",              LVecBase2f(fogNear, fogFar));
+  render.set_shader_input("previousWorldViewMat", invert(previousViewWorldMat));
+
+  // These move or animate so their last world transform is kept for the velocity buffer.
+
+  std::vector<MotionTrackedNode> motionTrackedNodes;
+  for (NodePath nodePath : { wheelNP, shuttersNP, weatherVaneNP, bannerNP }) {
+    MotionTrackedNode motionTrackedNode;
+    motionTrackedNode.nodePath         = nodePath;
+    motionTrackedNode.previousWorldMat = nodePath.get_transform(render)->get_mat();
+    trackSkinnedVertices(motionTrackedNode);
+    motionTrackedNodes.push_back(motionTrackedNode);
+  }
+  updateMotionTrackedNodes(render, motionTrackedNodes);
+
+  // Every buffer made below is kept here so they can all be resized together.
+  std::vector<FramebufferTexture> framebufferTextures;
 
   FramebufferTextureArguments framebufferTextureArguments;
-  framebufferTextureArguments.window         = window;
-  framebufferTextureArguments.graphicsOutput = graphicsOutput;
-  framebufferTextureArguments.graphicsEngine = graphicsEngine;
+  framebufferTextureArguments.window              = window;
+  framebufferTextureArguments.graphicsOutput      = graphicsOutput;
+  framebufferTextureArguments.graphicsEngine      = graphicsEngine;
+  framebufferTextureArguments.framebufferTextures = &framebufferTextures;
 
   framebufferTextureArguments.bitplane       = GraphicsOutput::RTP_color;
   framebufferTextureArguments.rgbaBits       = rgba32;
@@ -578,6 +1427,8 @@ int main
   framebufferTextureArguments.setSrgbColor   = false;
   framebufferTextureArguments.setRgbColor    = true;
   framebufferTextureArguments.useScene       = true;
+  framebufferTextureArguments.sizeDivisor    = 1;
+  framebufferTextureArguments.aux_rgba       = 4;
   framebufferTextureArguments.name           = "geometry0";
 
   FramebufferTexture geometryFramebufferTexture0 =
@@ -594,12 +1445,36 @@ int main
     );
   geometryBuffer0->set_clear_active(3, true);
   geometryBuffer0->set_clear_value( 3, framebufferTextureArguments.clearColor);
+  geometryBuffer0->add_render_texture
+    ( NULL
+    , GraphicsOutput::RTM_bind_or_copy
+    , GraphicsOutput::RTP_aux_rgba_1
+    );
+  geometryBuffer0->set_clear_active(4, true);
+  geometryBuffer0->set_clear_value( 4, framebufferTextureArguments.clearColor);
+  geometryBuffer0->add_render_texture
+    ( NULL
+    , GraphicsOutput::RTM_bind_or_copy
+    , GraphicsOutput::RTP_aux_rgba_2
+    );
+  geometryBuffer0->set_clear_active(5, true);
+  geometryBuffer0->set_clear_value( 5, framebufferTextureArguments.clearColor);
+  geometryBuffer0->add_render_texture
+    ( NULL
+    , GraphicsOutput::RTM_bind_or_copy
+    , GraphicsOutput::RTP_aux_rgba_3
+    );
+  geometryBuffer0->set_clear_active(6, true);
+  geometryBuffer0->set_clear_value( 6, framebufferTextureArguments.clearColor);
   geometryNP0.set_shader(geometryBufferShader0);
   geometryNP0.set_shader_input("normalMapsEnabled", normalMapsEnabled);
   geometryCamera0->set_initial_state(geometryNP0.get_state());
   geometryCamera0->set_camera_mask(BitMask32::bit(1));
   PT(Texture) positionTexture0    = geometryBuffer0->get_texture(0);
   PT(Texture) normalTexture0      = geometryBuffer0->get_texture(1);
+  PT(Texture) diffuseTexture0     = geometryBuffer0->get_texture(2);
+  PT(Texture) specularMapTexture0 = geometryBuffer0->get_texture(3);
+  PT(Texture) emissionTexture0    = geometryBuffer0->get_texture(4);
   PT(Lens)    geometryCameraLens0 = geometryCamera0->get_lens();
   waterNP.hide(BitMask32::bit(1));
   smokeNP.hide(BitMask32::bit(1));
@@ -679,50 +1554,22 @@ int main
   geometryBuffer2->set_clear_value( 3, framebufferTextureArguments.clearColor);
   geometryBuffer2->set_sort(geometryBuffer1->get_sort() + 1);
   geometryNP2.set_shader(geometryBufferShader2);
-  geometryNP2.set_shader_input("isSmoke",         LVecBase2f(0, 0));
-  geometryNP2.set_shader_input("positionTexture", positionTexture1);
+  geometryNP2.set_shader_input("motionMat",            LMatrix4::ident_mat());
   geometryCamera2->set_initial_state(geometryNP2.get_state());
-  geometryCamera2->set_tag_state_key("geometryBuffer2");
-  geometryCamera2->set_tag_state("isSmoke", isSmokeNP.get_state());
-  smokeNP.set_tag("geometryBuffer2", "isSmoke");
+  geometryCamera2->set_camera_mask(BitMask32::bit(3));
   PT(Texture) positionTexture2         = geometryBuffer2->get_texture(0);
-  PT(Texture) smokeMaskTexture         = geometryBuffer2->get_texture(1);
+  PT(Texture) velocityTexture          = geometryBuffer2->get_texture(1);
   PT(Lens)    geometryCameraLens2      = geometryCamera2->get_lens();
+  smokeNP.hide(BitMask32::bit(3));
 
   framebufferTextureArguments.rgbaBits      = rgba8;
   framebufferTextureArguments.aux_rgba      = 0;
-  framebufferTextureArguments.clearColor    = LColor(0, 0, 0, 0);
   framebufferTextureArguments.setFloatColor = false;
   framebufferTextureArguments.useScene      = false;
-  framebufferTextureArguments.name          = "fog";
+  framebufferTextureArguments.clearColor = LColor(1, 1, 1, 0);
+  framebufferTextureArguments.name       = "ssao";
 
-  FramebufferTexture fogFramebufferTexture =
-    generateFramebufferTexture
-      ( framebufferTextureArguments
-      );
-  PT(GraphicsOutput) fogBuffer = fogFramebufferTexture.buffer;
-  PT(Camera)         fogCamera = fogFramebufferTexture.camera;
-  NodePath           fogNP     = fogFramebufferTexture.shaderNP;
-  fogBuffer->set_sort(geometryBuffer2->get_sort() + 1);
-  fogNP.set_shader(fogShader);
-  fogNP.set_shader_input("pi",               PI_SHADER_INPUT);
-  fogNP.set_shader_input("gamma",            GAMMA_SHADER_INPUT);
-  fogNP.set_shader_input("backgroundColor0", backgroundColor[0]);
-  fogNP.set_shader_input("backgroundColor1", backgroundColor[1]);
-  fogNP.set_shader_input("positionTexture0", positionTexture1);
-  fogNP.set_shader_input("positionTexture1", positionTexture2);
-  fogNP.set_shader_input("smokeMaskTexture", smokeMaskTexture);
-  fogNP.set_shader_input("sunPosition",      LVecBase2f(sunlightP, 0));
-  fogNP.set_shader_input("origin",           cameraNP.get_relative_point(render, environmentNP.get_pos()));
-  fogNP.set_shader_input("nearFar",          LVecBase2f(fogNear, fogFar));
-  fogNP.set_shader_input("enabled",          fogEnabled);
-  fogCamera->set_initial_state(fogNP.get_state());
-  PT(Texture) fogTexture = fogBuffer->get_texture();
-
-  framebufferTextureArguments.clearColor = LColor(1, 1, 1, 0);
-  framebufferTextureArguments.name       = "ssao";
-
-  FramebufferTexture ssaoFramebufferTexture =
+  FramebufferTexture ssaoFramebufferTexture =
     generateFramebufferTexture
       ( framebufferTextureArguments
       );
@@ -733,11 +1580,10 @@ int main
   ssaoNP.set_shader(ssaoShader);
   ssaoNP.set_shader_input("positionTexture", positionTexture0);
   ssaoNP.set_shader_input("normalTexture",   normalTexture0);
-  ssaoNP.set_shader_input("samples",         generateSsaoSamples(SSAO_SAMPLES));
-  ssaoNP.set_shader_input("noise",           generateSsaoNoise(SSAO_NOISE));
+  ssaoNP.set_shader_input("samples",         generateSsaoSamples(quality.ssaoSamples));
+  ssaoNP.set_shader_input("noise",           generateSsaoNoise(quality.ssaoNoise));
   ssaoNP.set_shader_input("lensProjection",  geometryCameraLens0->get_projection_mat());
   ssaoNP.set_shader_input("enabled",         ssaoEnabled);
-  ssaoCamera->set_initial_state(ssaoNP.get_state());
 
   framebufferTextureArguments.name = "ssaoBlur";
 
@@ -751,7 +1597,6 @@ int main
   ssaoBlurNP.set_shader(kuwaharaFilterShader);
   ssaoBlurNP.set_shader_input("colorTexture", ssaoBuffer->get_texture());
   ssaoBlurNP.set_shader_input("parameters",   LVecBase2f(1, 0));
-  ssaoBlurFramebufferTexture.camera->set_initial_state(ssaoBlurNP.get_state());
   PT(Texture) ssaoBlurTexture = ssaoBlurBuffer->get_texture();
 
   framebufferTextureArguments.rgbaBits   = rgba16;
@@ -773,7 +1618,6 @@ int main
   refractionUvNP.set_shader_input("lensProjection",      geometryCameraLens0->get_projection_mat());
   refractionUvNP.set_shader_input("enabled",             refractionEnabled);
   refractionUvNP.set_shader_input("rior",                rior);
-  refractionUvCamera->set_initial_state(refractionUvNP.get_state());
   PT(Texture) refractionUvTexture = refractionUvBuffer->get_texture();
 
   framebufferTextureArguments.name = "reflectionUv";
@@ -792,11 +1636,10 @@ int main
   reflectionUvNP.set_shader_input("maskTexture",     reflectionMaskTexture);
   reflectionUvNP.set_shader_input("lensProjection",  geometryCameraLens0->get_projection_mat());
   reflectionUvNP.set_shader_input("enabled",         reflectionEnabled);
-  reflectionUvCamera->set_initial_state(reflectionUvNP.get_state());
   PT(Texture) reflectionUvTexture = reflectionUvBuffer->get_texture();
 
   framebufferTextureArguments.rgbaBits = rgba8;
-  framebufferTextureArguments.aux_rgba = 1;
+  framebufferTextureArguments.aux_rgba = 2;
   framebufferTextureArguments.useScene = true;
   framebufferTextureArguments.name     = "base";
 
@@ -814,6 +1657,13 @@ int main
     );
   baseBuffer->set_clear_active(3, true);
   baseBuffer->set_clear_value( 3, framebufferTextureArguments.clearColor);
+  baseBuffer->add_render_texture
+    ( NULL
+    , GraphicsOutput::RTM_bind_or_copy
+    , GraphicsOutput::RTP_aux_rgba_1
+    );
+  baseBuffer->set_clear_active(4, true);
+  baseBuffer->set_clear_value( 4, framebufferTextureArguments.clearColor);
   baseBuffer->set_sort
     ( std::max
         ( ssaoBlurBuffer->get_sort() + 1
@@ -824,6 +1674,7 @@ int main
   baseNP.set_shader_input("pi",                PI_SHADER_INPUT);
   baseNP.set_shader_input("gamma",             GAMMA_SHADER_INPUT);
   baseNP.set_shader_input("ssaoBlurTexture",   ssaoBlurTexture);
+  baseNP.set_shader_input("positionTexture",   positionTexture2);
   baseNP.set_shader_input("flowTexture",       stillFlowTexture);
   baseNP.set_shader_input("normalMapsEnabled", normalMapsEnabled);
   baseNP.set_shader_input("blinnPhongEnabled", blinnPhongEnabled);
@@ -834,20 +1685,112 @@ int main
   baseNP.set_shader_input("specularOnly",      LVecBase2f(0, 0));
   baseNP.set_shader_input("isParticle",        LVecBase2f(0, 0));
   baseNP.set_shader_input("isWater",           LVecBase2f(0, 0));
-  baseNP.set_shader_input("sunPosition",       LVecBase2f(sunlightP, 0));
-  baseCamera->set_initial_state(baseNP.get_state());
   baseCamera->set_tag_state_key("baseBuffer");
-  baseCamera->set_tag_state("isParticle", isSmokeNP.get_state());
-  baseCamera->set_tag_state("isWater",    isWaterNP.get_state());
   baseCamera->set_camera_mask(BitMask32::bit(6));
   smokeNP.set_tag("baseBuffer", "isParticle");
   waterNP.set_tag("baseBuffer", "isWater");
-  PT(Texture) baseTexture     = baseBuffer->get_texture(0);
-  PT(Texture) specularTexture = baseBuffer->get_texture(1);
+  PT(Texture) baseTexture      = baseBuffer->get_texture(0);
+  PT(Texture) specularTexture  = baseBuffer->get_texture(1);
+  PT(Texture) smokeMaskTexture = baseBuffer->get_texture(2);
+
+  // In deferred mode, the opaque geometry only lays down depth in the base pass.
+  // Its lighting comes from a full screen pass over geometry buffer 0
+  // that runs first in the same buffer.
+  // The water and smoke are still lit forward on top of it.
+
+  NodePath baseDepthOnlyNP = NodePath("baseDepthOnly");
+  baseDepthOnlyNP.set_shader(depthOnlyShader);
+  baseDepthOnlyNP.set_attrib(ColorWriteAttrib::make(ColorWriteAttrib::C_off));
+
+  NodePath baseForwardNP = NodePath("baseForward");
+  baseForwardNP.set_attrib(ColorWriteAttrib::make(ColorWriteAttrib::C_all));
+
+  auto setBaseCameraState =
+    [&]() -> void {
+      if (deferredLightingEnabled[0] == 1) {
+        CPT(RenderState) forwardState =
+          baseForwardNP.get_state()->compose(baseNP.get_state());
+        stageInitialState(frameCommit, baseCamera, baseDepthOnlyNP);
+        stageTagState(frameCommit, baseCamera, "isParticle", forwardState->compose(isSmokeNP.get_state()));
+        stageTagState(frameCommit, baseCamera, "isWater",    forwardState->compose(isWaterNP.get_state()));
+      } else {
+        stageInitialState(frameCommit, baseCamera, baseNP);
+        stageTagState(frameCommit, baseCamera, "isParticle", isSmokeNP.get_state());
+        stageTagState(frameCommit, baseCamera, "isWater",    isWaterNP.get_state());
+      }
+    };
+
+  setBaseCameraState();
+  commitFrame(frameCommit, graphicsEngine);
+
+  PT(Camera) deferredLightingCamera = new Camera("deferredLightingCamera");
+  PT(OrthographicLens) deferredLightingLens = new OrthographicLens();
+  deferredLightingLens->set_film_size(2, 2);
+  deferredLightingLens->set_film_offset(0, 0);
+  deferredLightingLens->set_near_far(-1, 1);
+  deferredLightingCamera->set_lens(deferredLightingLens);
+
+  // The camera follows the main camera so the lights end up in the same view space
+  // as the geometry buffer positions and normals.
+
+  NodePath deferredLightingRenderNP = NodePath("deferredLightingRender");
+  deferredLightingRenderNP.set_depth_test( false);
+  deferredLightingRenderNP.set_depth_write(false);
+  NodePath deferredLightingCameraNP = deferredLightingRenderNP.attach_new_node(deferredLightingCamera);
+  deferredLightingCameraNP.set_transform(cameraNP.get_transform(render));
+  NodePath deferredLightingNP = deferredLightingCameraNP.attach_new_node("deferredLightingShader");
+  CardMaker deferredLightingCard = CardMaker("deferredLighting");
+  deferredLightingCard.set_frame_fullscreen_quad();
+  deferredLightingCard.set_has_uvs(true);
+  deferredLightingNP.attach_new_node(deferredLightingCard.generate());
+
+  deferredLightingNP.set_shader(deferredLightingShader);
+  deferredLightingNP.set_shader_input("pi",                 PI_SHADER_INPUT);
+  deferredLightingNP.set_shader_input("gamma",              GAMMA_SHADER_INPUT);
+  deferredLightingNP.set_shader_input("positionTexture",    positionTexture0);
+  deferredLightingNP.set_shader_input("normalTexture",      normalTexture0);
+  deferredLightingNP.set_shader_input("diffuseTexture",     diffuseTexture0);
+  deferredLightingNP.set_shader_input("specularMapTexture", specularMapTexture0);
+  deferredLightingNP.set_shader_input("emissionTexture",    emissionTexture0);
+  deferredLightingNP.set_shader_input("ssaoBlurTexture",    ssaoBlurTexture);
+  deferredLightingNP.set_shader_input("blinnPhongEnabled",  blinnPhongEnabled);
+  deferredLightingNP.set_shader_input("fresnelEnabled",     fresnelEnabled);
+  deferredLightingNP.set_shader_input("rimLightEnabled",    rimLightEnabled);
+  deferredLightingNP.set_shader_input("celShadingEnabled",  celShadingEnabled);
+  deferredLightingNP.set_shader_input("sunPosition",        LVecBase2f(sunlightP, 0));
+
+  PT(DisplayRegion) deferredLightingRegion = baseBuffer->make_display_region(0, 1, 0, 1);
+  deferredLightingRegion->set_camera(deferredLightingCameraNP);
+  deferredLightingRegion->set_sort(0);
+  deferredLightingRegion->set_active(deferredLightingEnabled[0] == 1);
+  baseFramebufferTexture.bufferRegion->set_sort(1);
 
   framebufferTextureArguments.aux_rgba = 0;
   framebufferTextureArguments.useScene = false;
-  framebufferTextureArguments.name     = "refraction";
+  framebufferTextureArguments.name     = "fog";
+
+  FramebufferTexture fogFramebufferTexture =
+    generateFramebufferTexture
+      ( framebufferTextureArguments
+      );
+  PT(GraphicsOutput) fogBuffer = fogFramebufferTexture.buffer;
+  PT(Camera)         fogCamera = fogFramebufferTexture.camera;
+  NodePath           fogNP     = fogFramebufferTexture.shaderNP;
+  fogBuffer->set_sort(baseBuffer->get_sort() + 1);
+  fogNP.set_shader(fogShader);
+  fogNP.set_shader_input("pi",               PI_SHADER_INPUT);
+  fogNP.set_shader_input("gamma",            GAMMA_SHADER_INPUT);
+  fogNP.set_shader_input("backgroundColor0", backgroundColor[0]);
+  fogNP.set_shader_input("backgroundColor1", backgroundColor[1]);
+  fogNP.set_shader_input("positionTexture",  positionTexture2);
+  fogNP.set_shader_input("smokeMaskTexture", smokeMaskTexture);
+  fogNP.set_shader_input("sunPosition",      LVecBase2f(sunlightP, 0));
+  fogNP.set_shader_input("origin",           cameraNP.get_relative_point(render, environmentNP.get_pos()));
+  fogNP.set_shader_input("nearFar",          LVecBase2f(fogNear, fogFar));
+  fogNP.set_shader_input("enabled",          fogEnabled);
+  PT(Texture) fogTexture = fogBuffer->get_texture();
+
+  framebufferTextureArguments.name = "refraction";
 
   FramebufferTexture refractionFramebufferTexture =
     generateFramebufferTexture
@@ -866,7 +1809,6 @@ int main
   refractionNP.set_shader_input("positionToTexture",      positionTexture0);
   refractionNP.set_shader_input("backgroundColorTexture", baseTexture);
   refractionNP.set_shader_input("sunPosition",            LVecBase2f(sunlightP, 0));
-  refractionCamera->set_initial_state(refractionNP.get_state());
   PT(Texture) refractionTexture = refractionBuffer->get_texture();
 
   framebufferTextureArguments.name = "foam";
@@ -888,7 +1830,6 @@ int main
   foamNP.set_shader_input("viewWorldMat",        currentViewWorldMat);
   foamNP.set_shader_input("positionFromTexture", positionTexture1);
   foamNP.set_shader_input("positionToTexture",   positionTexture0);
-  foamCamera->set_initial_state(foamNP.get_state());
   PT(Texture) foamTexture = foamBuffer->get_texture();
 
   framebufferTextureArguments.name = "reflectionColor";
@@ -902,9 +1843,9 @@ int main
   NodePath           reflectionColorNP     = reflectionColorFramebufferTexture.shaderNP;
   reflectionColorBuffer->set_sort(refractionBuffer->get_sort() + 1);
   reflectionColorNP.set_shader(reflectionColorShader);
-  reflectionColorNP.set_shader_input("colorTexture", refractionTexture);
-  reflectionColorNP.set_shader_input("uvTexture",    reflectionUvTexture);
-  reflectionColorCamera->set_initial_state(reflectionColorNP.get_state());
+  reflectionColorNP.set_shader_input("colorTexture",           refractionTexture);
+  reflectionColorNP.set_shader_input("backgroundColorTexture", baseTexture);
+  reflectionColorNP.set_shader_input("uvTexture",              reflectionUvTexture);
   PT(Texture) reflectionColorTexture = reflectionColorBuffer->get_texture();
 
   framebufferTextureArguments.name = "reflectionColorBlur";
@@ -919,8 +1860,7 @@ int main
   reflectionColorBlurBuffer->set_sort(reflectionColorBuffer->get_sort() + 1);
   reflectionColorBlurNP.set_shader(boxBlurShader);
   reflectionColorBlurNP.set_shader_input("colorTexture", reflectionColorTexture);
-  reflectionColorBlurNP.set_shader_input("parameters",   LVecBase2f(8, 1));
-  reflectionColorBlurCamera->set_initial_state(reflectionColorBlurNP.get_state());
+  reflectionColorBlurNP.set_shader_input("parameters",   LVecBase2f(quality.reflectionBlurSize, 1));
   PT(Texture) reflectionColorBlurTexture = reflectionColorBlurBuffer->get_texture();
 
   framebufferTextureArguments.name = "reflection";
@@ -936,9 +1876,108 @@ int main
   reflectionNP.set_shader_input("colorTexture",     reflectionColorTexture);
   reflectionNP.set_shader_input("colorBlurTexture", reflectionColorBlurTexture);
   reflectionNP.set_shader_input("maskTexture",      reflectionMaskTexture);
-  reflectionFramebufferTexture.camera->set_initial_state(reflectionNP.get_state());
   PT(Texture) reflectionTexture = reflectionBuffer->get_texture();
 
+  // These passes only shade the water so they only draw where it is on screen.
+  // The water doesn't move so its bounds are found once.
+  std::vector<PT(DisplayRegion)> waterRegions =
+    { refractionUvFramebufferTexture.bufferRegion
+    , reflectionUvFramebufferTexture.bufferRegion
+    , refractionFramebufferTexture.bufferRegion
+    , foamFramebufferTexture.bufferRegion
+    , reflectionColorFramebufferTexture.bufferRegion
+    , reflectionColorBlurFramebufferTexture.bufferRegion
+    , reflectionFramebufferTexture.bufferRegion
+    };
+  LPoint3 waterBoundsMin;
+  LPoint3 waterBoundsMax;
+  bool    waterHasBounds = waterNP.calc_tight_bounds(waterBoundsMin, waterBoundsMax, waterNP);
+
+  // The water is flat so it can reflect a mirrored view of the scene instead of tracing the screen.
+  // That view skips the shadows and SSAO and is drawn at half size.
+  // The blur for rough water comes from its mipmaps rather than a blur pass.
+
+  bool planarReflection = waterReflectionMode.get_value() == "planar";
+  if (planarReflection && !waterHasBounds) {
+    printf("The water has no bounds so it falls back to screen space reflections.\n");
+    planarReflection = false;
+  }
+
+  LMatrix4 waterToWorld = waterNP.get_mat(render);
+  LVector3 waterUp      = waterToWorld.xform_vec(LVector3::up());
+  waterUp.normalize();
+  LPlane   waterPlane   = LPlane(waterUp, waterToWorld.xform_point(LPoint3(0, 0, waterBoundsMax[2])));
+  LMatrix4 waterMirror  = waterPlane.get_reflection_mat();
+
+  // The plane is in world space so it sits right under render. It only clips, so it isn't drawn.
+  NodePath waterPlaneNP = render.attach_new_node(new PlaneNode("waterPlane", waterPlane));
+  waterPlaneNP.hide();
+
+  framebufferTextureArguments.useScene    = true;
+  framebufferTextureArguments.sizeDivisor = 2;
+  framebufferTextureArguments.name        = "planarReflectionScene";
+
+  FramebufferTexture planarReflectionSceneFramebufferTexture =
+    generateFramebufferTexture
+      ( framebufferTextureArguments
+      );
+  PT(GraphicsOutput) planarReflectionSceneBuffer   = planarReflectionSceneFramebufferTexture.buffer;
+  PT(Camera)         planarReflectionSceneCamera   = planarReflectionSceneFramebufferTexture.camera;
+  NodePath           planarReflectionSceneCameraNP = planarReflectionSceneFramebufferTexture.cameraNP;
+  planarReflectionSceneBuffer->set_sort(baseBuffer->get_sort());
+  planarReflectionSceneCameraNP.reparent_to(render);
+  planarReflectionSceneCamera->set_camera_mask(BitMask32::bit(7));
+  waterNP.hide(BitMask32::bit(7));
+  smokeNP.hide(BitMask32::bit(7));
+
+  // The mirror flips the winding of every triangle
+  // and anything under the water would otherwise show up above it.
+  NodePath planarReflectionSceneNP = baseNP.attach_new_node("planarReflectionScene");
+  planarReflectionSceneNP.set_shader(planarReflectionSceneShader);
+  planarReflectionSceneNP.set_attrib(CullFaceAttrib::make_reverse());
+  planarReflectionSceneNP.set_clip_plane(waterPlaneNP);
+  planarReflectionSceneCamera->set_initial_state(planarReflectionSceneNP.get_net_state());
+
+  PT(Texture) planarReflectionSceneTexture = planarReflectionSceneBuffer->get_texture();
+  planarReflectionSceneTexture->set_minfilter(SamplerState::FT_linear_mipmap_linear);
+  planarReflectionSceneTexture->set_magfilter(SamplerState::FT_linear);
+  planarReflectionSceneTexture->set_wrap_u(SamplerState::WM_clamp);
+  planarReflectionSceneTexture->set_wrap_v(SamplerState::WM_clamp);
+
+  framebufferTextureArguments.useScene    = false;
+  framebufferTextureArguments.sizeDivisor = 1;
+  framebufferTextureArguments.name        = "planarReflection";
+
+  FramebufferTexture planarReflectionFramebufferTexture =
+    generateFramebufferTexture
+      ( framebufferTextureArguments
+      );
+  PT(GraphicsOutput) planarReflectionBuffer = planarReflectionFramebufferTexture.buffer;
+  PT(Camera)         planarReflectionCamera = planarReflectionFramebufferTexture.camera;
+  NodePath           planarReflectionNP     = planarReflectionFramebufferTexture.shaderNP;
+  planarReflectionBuffer->set_sort(planarReflectionSceneBuffer->get_sort() + 1);
+  planarReflectionNP.set_shader(planarReflectionShader);
+  planarReflectionNP.set_shader_input("colorTexture",  planarReflectionSceneTexture);
+  planarReflectionNP.set_shader_input("maskTexture",   reflectionMaskTexture);
+  planarReflectionNP.set_shader_input("normalTexture", normalTexture1);
+  planarReflectionNP.set_shader_input("planeNormal",   cameraNP.get_relative_vector(render, waterUp));
+  planarReflectionNP.set_shader_input("enabled",       reflectionEnabled);
+
+  if (planarReflection) {
+    reflectionUvBuffer->set_active(false);
+    reflectionColorBuffer->set_active(false);
+    reflectionColorBlurBuffer->set_active(false);
+    reflectionBuffer->set_active(false);
+    reflectionTexture = planarReflectionBuffer->get_texture();
+  } else {
+    planarReflectionSceneBuffer->set_active(false);
+    planarReflectionBuffer->set_active(false);
+  }
+
+  // The mirrored scene stays full screen.
+  // Shrinking its region would squeeze the whole view into the water's rectangle rather than crop it.
+  waterRegions.push_back(planarReflectionFramebufferTexture.bufferRegion);
+
   framebufferTextureArguments.name = "baseCombine";
 
   FramebufferTexture baseCombineFramebufferTexture =
@@ -955,7 +1994,6 @@ int main
   baseCombineNP.set_shader_input("foamTexture",       foamTexture);
   baseCombineNP.set_shader_input("reflectionTexture", reflectionTexture);
   baseCombineNP.set_shader_input("specularTexture",   specularTexture);
-  baseCombineCamera->set_initial_state(baseCombineNP.get_state());
   PT(Texture) baseCombineTexture = baseCombineBuffer->get_texture();
 
   framebufferTextureArguments.name = "sharpen";
@@ -971,7 +2009,6 @@ int main
   sharpenNP.set_shader_input("colorTexture", baseCombineTexture);
   sharpenNP.set_shader_input("enabled",      sharpenEnabled);
   PT(Camera) sharpenCamera = sharpenFramebufferTexture.camera;
-  sharpenCamera->set_initial_state(sharpenNP.get_state());
   PT(Texture) sharpenTexture = sharpenBuffer->get_texture();
 
   framebufferTextureArguments.name = "posterize";
@@ -989,10 +2026,69 @@ int main
   posterizeNP.set_shader_input("positionTexture", positionTexture2);
   posterizeNP.set_shader_input("enabled",         posterizeEnabled);
   PT(Camera) posterizeCamera = posterizeFramebufferTexture.camera;
-  posterizeCamera->set_initial_state(posterizeNP.get_state());
   PT(Texture) posterizeTexture = posterizeBuffer->get_texture();
 
-  framebufferTextureArguments.name = "bloom";
+  // The bloom is built from a chain of ever smaller buffers.
+  // The first downsample thresholds the bright parts,
+  // then each level is tent filtered back up and added to the level above it.
+
+  std::vector<FramebufferTexture> bloomDownsampleFramebufferTextures;
+  std::vector<FramebufferTexture> bloomUpsampleFramebufferTextures;
+
+  int         bloomSort         = posterizeBuffer->get_sort();
+  PT(Texture) bloomInputTexture = posterizeTexture;
+
+  // The levels are summed so they need room above one.
+
+  framebufferTextureArguments.rgbaBits      = rgba16;
+  framebufferTextureArguments.setFloatColor = true;
+
+  for (int i = 0; i < quality.bloomLevels; ++i) {
+    framebufferTextureArguments.sizeDivisor = 2 << i;
+    framebufferTextureArguments.name        = "bloomDownsample" + std::to_string(i);
+
+    FramebufferTexture bloomDownsampleFramebufferTexture =
+      generateFramebufferTexture
+        ( framebufferTextureArguments
+        );
+    NodePath bloomDownsampleNP = bloomDownsampleFramebufferTexture.shaderNP;
+    bloomDownsampleFramebufferTexture.buffer->set_sort(++bloomSort);
+    bloomDownsampleNP.set_shader(bloomDownsampleShader);
+    bloomDownsampleNP.set_shader_input("colorTexture", bloomInputTexture);
+    bloomDownsampleNP.set_shader_input("parameters",   LVecBase2f(i == 0 ? 1 : 0, 0.6));
+    bloomInputTexture = bloomDownsampleFramebufferTexture.buffer->get_texture();
+    setTextureToLinearAndClamp(bloomInputTexture);
+
+    bloomDownsampleFramebufferTextures.push_back(bloomDownsampleFramebufferTexture);
+  }
+
+  for (int i = quality.bloomLevels - 2; i >= 0; --i) {
+    framebufferTextureArguments.sizeDivisor = 2 << i;
+    framebufferTextureArguments.name        = "bloomUpsample" + std::to_string(i);
+
+    FramebufferTexture bloomUpsampleFramebufferTexture =
+      generateFramebufferTexture
+        ( framebufferTextureArguments
+        );
+    NodePath bloomUpsampleNP = bloomUpsampleFramebufferTexture.shaderNP;
+    bloomUpsampleFramebufferTexture.buffer->set_sort(++bloomSort);
+    bloomUpsampleNP.set_shader(bloomUpsampleShader);
+    bloomUpsampleNP.set_shader_input("colorTexture", bloomInputTexture);
+    bloomUpsampleNP.set_shader_input("baseTexture",  bloomDownsampleFramebufferTextures[i].buffer->get_texture());
+    bloomUpsampleNP.set_shader_input("parameters",   LVecBase2f(1, 0));
+    bloomInputTexture = bloomUpsampleFramebufferTexture.buffer->get_texture();
+    setTextureToLinearAndClamp(bloomInputTexture);
+
+    bloomUpsampleFramebufferTextures.push_back(bloomUpsampleFramebufferTexture);
+  }
+
+  PT(GraphicsOutput) bloomPrefilterBuffer = bloomDownsampleFramebufferTextures.front().buffer;
+  PT(GraphicsOutput) bloomUpsampleBuffer  = bloomUpsampleFramebufferTextures.back().buffer;
+
+  framebufferTextureArguments.rgbaBits      = rgba8;
+  framebufferTextureArguments.setFloatColor = false;
+  framebufferTextureArguments.sizeDivisor   = 1;
+  framebufferTextureArguments.name          = "bloom";
 
   FramebufferTexture bloomFramebufferTexture =
     generateFramebufferTexture
@@ -1001,11 +2097,11 @@ int main
   PT(GraphicsOutput) bloomBuffer = bloomFramebufferTexture.buffer;
   PT(Camera)         bloomCamera = bloomFramebufferTexture.camera;
   NodePath           bloomNP     = bloomFramebufferTexture.shaderNP;
-  bloomBuffer->set_sort(posterizeBuffer->get_sort() + 1);
+  bloomBuffer->set_sort(++bloomSort);
   bloomNP.set_shader(bloomShader);
-  bloomNP.set_shader_input("colorTexture", posterizeTexture);
+  bloomNP.set_shader_input("colorTexture", bloomInputTexture);
   bloomNP.set_shader_input("enabled",      bloomEnabled);
-  bloomCamera->set_initial_state(bloomNP.get_state());
+  bloomNP.set_shader_input("parameters",   LVecBase2f(quality.bloomLevels, 0));
   PT(Texture) bloomTexture = bloomBuffer->get_texture();
 
   framebufferTextureArguments.name = "sceneCombine";
@@ -1029,10 +2125,46 @@ int main
   sceneCombineNP.set_shader_input("fogTexture",          fogTexture);
   sceneCombineNP.set_shader_input("sunPosition",         LVecBase2f(sunlightP, 0));
   PT(Texture) sceneCombineTexture = sceneCombineBuffer->get_texture();
-  sceneCombineCamera->set_initial_state(sceneCombineNP.get_state());
 
-  framebufferTextureArguments.clearColor = backgroundColor[1];
-  framebufferTextureArguments.name       = "outOfFocus";
+  framebufferTextureArguments.sizeDivisor = DEPTH_OF_FIELD_TILE_SIZE;
+  framebufferTextureArguments.name        = "depthOfFieldTiles";
+
+  // Each texel holds the least and most blur found in its tile of the screen.
+
+  FramebufferTexture depthOfFieldTilesFramebufferTexture =
+    generateFramebufferTexture
+      ( framebufferTextureArguments
+      );
+  PT(GraphicsOutput) depthOfFieldTilesBuffer = depthOfFieldTilesFramebufferTexture.buffer;
+  PT(Camera)         depthOfFieldTilesCamera = depthOfFieldTilesFramebufferTexture.camera;
+  NodePath           depthOfFieldTilesNP     = depthOfFieldTilesFramebufferTexture.shaderNP;
+  depthOfFieldTilesBuffer->set_sort(sceneCombineBuffer->get_sort() + 1);
+  depthOfFieldTilesNP.set_shader(depthOfFieldTilesShader);
+  depthOfFieldTilesNP.set_shader_input("positionTexture", positionTexture0);
+  depthOfFieldTilesNP.set_shader_input("mouseFocusPoint", mouseFocusPoint);
+  depthOfFieldTilesNP.set_shader_input("parameters",      LVecBase2f(DEPTH_OF_FIELD_TILE_SIZE, 0));
+  PT(Texture) depthOfFieldTilesTexture = depthOfFieldTilesBuffer->get_texture();
+  setTextureToNearestAndClamp(depthOfFieldTilesTexture);
+
+  framebufferTextureArguments.name = "depthOfFieldNeighborTiles";
+
+  FramebufferTexture depthOfFieldNeighborTilesFramebufferTexture =
+    generateFramebufferTexture
+      ( framebufferTextureArguments
+      );
+  PT(GraphicsOutput) depthOfFieldNeighborTilesBuffer = depthOfFieldNeighborTilesFramebufferTexture.buffer;
+  NodePath           depthOfFieldNeighborTilesNP     = depthOfFieldNeighborTilesFramebufferTexture.shaderNP;
+  depthOfFieldNeighborTilesBuffer->set_sort(depthOfFieldTilesBuffer->get_sort() + 1);
+  depthOfFieldNeighborTilesNP.set_shader(depthOfFieldNeighborShader);
+  depthOfFieldNeighborTilesNP.set_shader_input("tileTexture", depthOfFieldTilesTexture);
+  PT(Texture) depthOfFieldNeighborTilesTexture = depthOfFieldNeighborTilesBuffer->get_texture();
+  setTextureToNearestAndClamp(depthOfFieldNeighborTilesTexture);
+
+  framebufferTextureArguments.clearColor  = backgroundColor[1];
+  framebufferTextureArguments.sizeDivisor = 2;
+  framebufferTextureArguments.name        = "outOfFocus";
+
+  // The blur is gathered at half resolution and skipped wherever the tiles say it's in focus.
 
   FramebufferTexture outOfFocusFramebufferTexture =
     generateFramebufferTexture
@@ -1041,28 +2173,16 @@ int main
   PT(GraphicsOutput) outOfFocusBuffer = outOfFocusFramebufferTexture.buffer;
   PT(Camera)         outOfFocusCamera = outOfFocusFramebufferTexture.camera;
   NodePath           outOfFocusNP     = outOfFocusFramebufferTexture.shaderNP;
-  outOfFocusBuffer->set_sort(sceneCombineBuffer->get_sort() + 1);
-  outOfFocusNP.set_shader(boxBlurShader);
+  outOfFocusBuffer->set_sort(depthOfFieldNeighborTilesBuffer->get_sort() + 1);
+  outOfFocusNP.set_shader(depthOfFieldGatherShader);
   outOfFocusNP.set_shader_input("colorTexture", sceneCombineTexture);
-  outOfFocusNP.set_shader_input("parameters",   LVecBase2f(2, 2));
-  outOfFocusCamera->set_initial_state(outOfFocusNP.get_state());
+  outOfFocusNP.set_shader_input("tileTexture",  depthOfFieldNeighborTilesTexture);
+  outOfFocusNP.set_shader_input("parameters",   LVecBase2f(quality.depthOfFieldBlurSize, 1));
+  outOfFocusNP.set_shader_input("enabled",      depthOfFieldEnabled);
   PT(Texture) outOfFocusTexture = outOfFocusBuffer->get_texture();
+  setTextureToLinearAndClamp(outOfFocusTexture);
 
-  framebufferTextureArguments.name = "dilatedOutOfFocus";
-
-  FramebufferTexture dilatedOutOfFocusFramebufferTexture =
-    generateFramebufferTexture
-      ( framebufferTextureArguments
-      );
-  PT(GraphicsOutput) dilatedOutOfFocusBuffer = dilatedOutOfFocusFramebufferTexture.buffer;
-  PT(Camera)         dilatedOutOfFocusCamera = dilatedOutOfFocusFramebufferTexture.camera;
-  NodePath           dilatedOutOfFocusNP     = dilatedOutOfFocusFramebufferTexture.shaderNP;
-  dilatedOutOfFocusBuffer->set_sort(outOfFocusBuffer->get_sort() + 1);
-  dilatedOutOfFocusNP.set_shader(dilationShader);
-  dilatedOutOfFocusNP.set_shader_input("colorTexture", outOfFocusTexture);
-  dilatedOutOfFocusNP.set_shader_input("parameters",   LVecBase2f(4, 2));
-  dilatedOutOfFocusCamera->set_initial_state(dilatedOutOfFocusNP.get_state());
-  PT(Texture) dilatedOutOfFocusTexture = dilatedOutOfFocusBuffer->get_texture();
+  framebufferTextureArguments.sizeDivisor = 1;
 
   framebufferTextureArguments.aux_rgba = 1;
   framebufferTextureArguments.name     = "depthOfField";
@@ -1080,16 +2200,16 @@ int main
     );
   depthOfFieldBuffer->set_clear_active(3, true);
   depthOfFieldBuffer->set_clear_value( 3, framebufferTextureArguments.clearColor);
-  depthOfFieldBuffer->set_sort(dilatedOutOfFocusBuffer->get_sort() + 1);
+  depthOfFieldBuffer->set_sort(outOfFocusBuffer->get_sort() + 1);
   depthOfFieldNP.set_shader(depthOfFieldShader);
   depthOfFieldNP.set_shader_input("positionTexture",   positionTexture0);
   depthOfFieldNP.set_shader_input("focusTexture",      sceneCombineTexture);
-  depthOfFieldNP.set_shader_input("outOfFocusTexture", dilatedOutOfFocusTexture);
+  depthOfFieldNP.set_shader_input("outOfFocusTexture", outOfFocusTexture);
+  depthOfFieldNP.set_shader_input("tileTexture",       depthOfFieldNeighborTilesTexture);
   depthOfFieldNP.set_shader_input("mouseFocusPoint",   mouseFocusPoint);
   depthOfFieldNP.set_shader_input("nearFar",           cameraNearFar);
   depthOfFieldNP.set_shader_input("enabled",           depthOfFieldEnabled);
   PT(Camera) depthOfFieldCamera = depthOfFieldFramebufferTexture.camera;
-  depthOfFieldCamera->set_initial_state(depthOfFieldNP.get_state());
   PT(Texture) depthOfFieldTexture0 = depthOfFieldBuffer->get_texture(0);
   PT(Texture) depthOfFieldTexture1 = depthOfFieldBuffer->get_texture(1);
 
@@ -1113,7 +2233,6 @@ int main
   outlineNP.set_shader_input("fogTexture",          fogTexture);
   outlineNP.set_shader_input("nearFar",             cameraNearFar);
   outlineNP.set_shader_input("enabled",             outlineEnabled);
-  outlineCamera->set_initial_state(outlineNP.get_state());
   PT(Texture) outlineTexture = outlineBuffer->get_texture();
 
   framebufferTextureArguments.name = "painterly";
@@ -1129,7 +2248,6 @@ int main
   painterlyNP.set_shader_input("colorTexture", outlineTexture);
   painterlyNP.set_shader_input("parameters",   LVecBase2f(0, 0));
   PT(Camera) painterlyCamera = painterlyFramebufferTexture.camera;
-  painterlyCamera->set_initial_state(painterlyNP.get_state());
   PT(Texture) painterlyTexture = painterlyBuffer->get_texture();
 
   framebufferTextureArguments.name = "pixelize";
@@ -1147,10 +2265,46 @@ int main
   pixelizeNP.set_shader_input("parameters",      LVecBase2f(5, 0));
   pixelizeNP.set_shader_input("enabled",         pixelizeEnabled);
   PT(Camera) pixelizeCamera = pixelizeFramebufferTexture.camera;
-  pixelizeCamera->set_initial_state(pixelizeNP.get_state());
   PT(Texture) pixelizeTexture = pixelizeBuffer->get_texture();
 
-  framebufferTextureArguments.name = "motionBlur";
+  framebufferTextureArguments.sizeDivisor = VELOCITY_TILE_SIZE;
+  framebufferTextureArguments.rgbaBits    = rgba16;
+  framebufferTextureArguments.setFloatColor = true;
+  framebufferTextureArguments.name        = "velocityTiles";
+
+  // Each texel holds the fastest velocity in its tile of the screen.
+
+  FramebufferTexture velocityTilesFramebufferTexture =
+    generateFramebufferTexture
+      ( framebufferTextureArguments
+      );
+  PT(GraphicsOutput) velocityTilesBuffer = velocityTilesFramebufferTexture.buffer;
+  NodePath           velocityTilesNP     = velocityTilesFramebufferTexture.shaderNP;
+  velocityTilesBuffer->set_sort(pixelizeBuffer->get_sort() + 1);
+  velocityTilesNP.set_shader(velocityTilesShader);
+  velocityTilesNP.set_shader_input("velocityTexture", velocityTexture);
+  velocityTilesNP.set_shader_input("parameters",      LVecBase2f(VELOCITY_TILE_SIZE, 0));
+  PT(Texture) velocityTilesTexture = velocityTilesBuffer->get_texture();
+  setTextureToNearestAndClamp(velocityTilesTexture);
+
+  framebufferTextureArguments.name = "velocityNeighborTiles";
+
+  FramebufferTexture velocityNeighborTilesFramebufferTexture =
+    generateFramebufferTexture
+      ( framebufferTextureArguments
+      );
+  PT(GraphicsOutput) velocityNeighborTilesBuffer = velocityNeighborTilesFramebufferTexture.buffer;
+  NodePath           velocityNeighborTilesNP     = velocityNeighborTilesFramebufferTexture.shaderNP;
+  velocityNeighborTilesBuffer->set_sort(velocityTilesBuffer->get_sort() + 1);
+  velocityNeighborTilesNP.set_shader(velocityNeighborShader);
+  velocityNeighborTilesNP.set_shader_input("tileTexture", velocityTilesTexture);
+  PT(Texture) velocityNeighborTilesTexture = velocityNeighborTilesBuffer->get_texture();
+  setTextureToNearestAndClamp(velocityNeighborTilesTexture);
+
+  framebufferTextureArguments.sizeDivisor   = 1;
+  framebufferTextureArguments.rgbaBits      = rgba8;
+  framebufferTextureArguments.setFloatColor = false;
+  framebufferTextureArguments.name          = "motionBlur";
 
   FramebufferTexture motionBlurFramebufferTexture =
     generateFramebufferTexture
@@ -1158,17 +2312,14 @@ int main
       );
   PT(GraphicsOutput) motionBlurBuffer = motionBlurFramebufferTexture.buffer;
   NodePath           motionBlurNP     = motionBlurFramebufferTexture.shaderNP;
-  motionBlurBuffer->set_sort(pixelizeBuffer->get_sort() + 1);
+  motionBlurBuffer->set_sort(velocityNeighborTilesBuffer->get_sort() + 1);
   motionBlurNP.set_shader(motionBlurShader);
-  motionBlurNP.set_shader_input("previousViewWorldMat",    previousViewWorldMat);
-  motionBlurNP.set_shader_input("worldViewMat",            render.get_transform(cameraNP)->get_mat());
-  motionBlurNP.set_shader_input("lensProjection",          geometryCameraLens2->get_projection_mat());
-  motionBlurNP.set_shader_input("positionTexture",         positionTexture2);
+  motionBlurNP.set_shader_input("velocityTexture",         velocityTexture);
+  motionBlurNP.set_shader_input("tileTexture",             velocityNeighborTilesTexture);
   motionBlurNP.set_shader_input("colorTexture",            pixelizeTexture);
   motionBlurNP.set_shader_input("motionBlurEnabled",       motionBlurEnabled);
   motionBlurNP.set_shader_input("parameters",              LVecBase2f(2, 1.0));
   PT(Camera) motionBlurCamera = motionBlurFramebufferTexture.camera;
-  motionBlurCamera->set_initial_state(motionBlurNP.get_state());
   PT(Texture) motionBlurTexture = motionBlurBuffer->get_texture();
 
   framebufferTextureArguments.name = "filmGrain";
@@ -1185,7 +2336,6 @@ int main
   filmGrainNP.set_shader_input("colorTexture", motionBlurTexture);
   filmGrainNP.set_shader_input("enabled",      filmGrainEnabled);
   PT(Camera) filmGrainCamera = filmGrainFramebufferTexture.camera;
-  filmGrainCamera->set_initial_state(filmGrainNP.get_state());
   PT(Texture) filmGrainTexture = filmGrainBuffer->get_texture();
 
   framebufferTextureArguments.name = "lookupTable";
@@ -1198,16 +2348,11 @@ int main
   NodePath           lookupTableNP     = lookupTableFramebufferTexture.shaderNP;
   lookupTableBuffer->set_sort(filmGrainBuffer->get_sort() + 1);
   lookupTableNP.set_shader(lookupTableShader);
-  lookupTableNP.set_shader_input("pi",                  PI_SHADER_INPUT);
-  lookupTableNP.set_shader_input("gamma",               GAMMA_SHADER_INPUT);
-  lookupTableNP.set_shader_input("colorTexture",        filmGrainTexture);
-  lookupTableNP.set_shader_input("lookupTableTextureN", colorLookupTableTextureN);
-  lookupTableNP.set_shader_input("lookupTableTexture0", colorLookupTableTexture0);
-  lookupTableNP.set_shader_input("lookupTableTexture1", colorLookupTableTexture1);
-  lookupTableNP.set_shader_input("sunPosition",         LVecBase2f(sunlightP, 0));
-  lookupTableNP.set_shader_input("enabled",             lookupTableEnabled);
+  lookupTableNP.set_shader_input("gamma",              GAMMA_SHADER_INPUT);
+  lookupTableNP.set_shader_input("colorTexture",       filmGrainTexture);
+  lookupTableNP.set_shader_input("lookupTableTexture", colorLookupTableTexture3d);
+  lookupTableNP.set_shader_input("enabled",            lookupTableEnabled);
   PT(Camera) lookupTableCamera = lookupTableFramebufferTexture.camera;
-  lookupTableCamera->set_initial_state(lookupTableNP.get_state());
   PT(Texture) lookupTableTexture = lookupTableBuffer->get_texture();
 
   framebufferTextureArguments.name = "gammaCorrection";
@@ -1223,7 +2368,6 @@ int main
   gammaCorrectionNP.set_shader_input("gamma",        GAMMA_SHADER_INPUT);
   gammaCorrectionNP.set_shader_input("colorTexture", lookupTableTexture);
   PT(Camera) gammaCorrectionCamera = gammaCorrectionFramebufferTexture.camera;
-  gammaCorrectionCamera->set_initial_state(gammaCorrectionNP.get_state());
   PT(Texture) gammaCorrectionTexture = gammaCorrectionBuffer->get_texture();
 
   framebufferTextureArguments.name = "chromaticAberration";
@@ -1240,7 +2384,6 @@ int main
   chromaticAberrationNP.set_shader_input("colorTexture",    gammaCorrectionTexture);
   chromaticAberrationNP.set_shader_input("enabled",         chromaticAberrationEnabled);
   PT(Camera) chromaticAberrationCamera = chromaticAberrationFramebufferTexture.camera;
-  chromaticAberrationCamera->set_initial_state(chromaticAberrationNP.get_state());
 
   graphicsOutput->set_sort(chromaticAberrationBuffer->get_sort() + 1);
 
@@ -1249,13 +2392,16 @@ int main
   std::vector<std::tuple<std::string, PT(GraphicsOutput), int>> bufferArray =
     { std::make_tuple("Positions 0",          geometryBuffer0,           0)
     , std::make_tuple("Normals 0",            geometryBuffer0,           1)
+    , std::make_tuple("Diffuse 0",            geometryBuffer0,           2)
+    , std::make_tuple("Specular Map 0",       geometryBuffer0,           3)
+    , std::make_tuple("Emission 0",           geometryBuffer0,           4)
     , std::make_tuple("Positions 1",          geometryBuffer1,           0)
     , std::make_tuple("Normals 1",            geometryBuffer1,           1)
     , std::make_tuple("Reflection Mask",      geometryBuffer1,           2)
     , std::make_tuple("Refraction Mask",      geometryBuffer1,           3)
     , std::make_tuple("Foam Mask",            geometryBuffer1,           4)
     , std::make_tuple("Positions 2",          geometryBuffer2,           0)
-    , std::make_tuple("Smoke Mask",           geometryBuffer2,           1)
+    , std::make_tuple("Velocity",             geometryBuffer2,           1)
     , std::make_tuple("SSAO",                 ssaoBuffer,                0)
     , std::make_tuple("SSAO Blur",            ssaoBlurBuffer,            0)
     , std::make_tuple("Refraction UV",        refractionUvBuffer,        0)
@@ -1264,21 +2410,27 @@ int main
     , std::make_tuple("Reflection Color",     reflectionColorBuffer,     0)
     , std::make_tuple("Reflection Blur",      reflectionColorBlurBuffer, 0)
     , std::make_tuple("Reflection",           reflectionBuffer,          0)
+    , std::make_tuple("Planar Reflection Scene", planarReflectionSceneBuffer, 0)
+    , std::make_tuple("Planar Reflection",    planarReflectionBuffer,    0)
     , std::make_tuple("Foam",                 foamBuffer,                0)
     , std::make_tuple("Base",                 baseBuffer,                0)
     , std::make_tuple("Specular",             baseBuffer,                1)
+    , std::make_tuple("Smoke Mask",           baseBuffer,                2)
     , std::make_tuple("Base Combine",         baseCombineBuffer,         0)
     , std::make_tuple("Painterly",            painterlyBuffer,           0)
     , std::make_tuple("Posterize",            posterizeBuffer,           0)
+    , std::make_tuple("Bloom Prefilter",      bloomPrefilterBuffer,      0)
+    , std::make_tuple("Bloom Upsample",       bloomUpsampleBuffer,       0)
     , std::make_tuple("Bloom",                bloomBuffer,               0)
     , std::make_tuple("Outline",              outlineBuffer,             0)
     , std::make_tuple("Fog",                  fogBuffer,                 0)
     , std::make_tuple("Scene Combine",        sceneCombineBuffer,        0)
+    , std::make_tuple("Depth of Field Tiles", depthOfFieldNeighborTilesBuffer, 0)
     , std::make_tuple("Out of Focus",         outOfFocusBuffer,          0)
-    , std::make_tuple("Dilation",             dilatedOutOfFocusBuffer,   0)
     , std::make_tuple("Depth of Field Blur",  depthOfFieldBuffer,        1)
     , std::make_tuple("Depth of Field",       depthOfFieldBuffer,        0)
     , std::make_tuple("Pixelize",             pixelizeBuffer,            0)
+    , std::make_tuple("Velocity Tiles",       velocityNeighborTilesBuffer, 0)
     , std::make_tuple("Motion Blur",          motionBlurBuffer,          0)
     , std::make_tuple("Film Grain",           filmGrainBuffer,           0)
     , std::make_tuple("Lookup Table",         lookupTableBuffer,         0)
@@ -1299,20 +2451,114 @@ int main
   weatherVaneAnimationCollection.loop("weather-vane-shake", true);
   bannerAnimationCollection.loop(     "banner-swing",       true);
 
-  int then          = microsecondsSinceEpoch();
-  int loopStartedAt = then;
-  int now           = then;
-  int keyTime       = now;
+  FramePacer framePacer;
+  setUpFramePacer(framePacer, frameRateTarget, framePacerLowLatency);
+
+  RenderSuspension renderSuspension;
+  renderSuspension.suspended = false;
+
+  ResizeController resizeController;
+  setUpResizeController(resizeController, graphicsOutput);
+
+  FrameTimes frameTimes;
+  resetFrameTimes(frameTimes, FRAME_TIME_SAMPLES);
+
+  int autotuneFrames = 0;
+
+  std::vector<std::tuple<std::string, LVecBase2f*>> effectToggles =
+    { std::make_tuple("SSAO",                 &ssaoEnabled)
+    , std::make_tuple("Refraction",           &refractionEnabled)
+    , std::make_tuple("Reflection",           &reflectionEnabled)
+    , std::make_tuple("Bloom",                &bloomEnabled)
+    , std::make_tuple("Normal Maps",          &normalMapsEnabled)
+    , std::make_tuple("Fog",                  &fogEnabled)
+    , std::make_tuple("Outline",              &outlineEnabled)
+    , std::make_tuple("Cel Shading",          &celShadingEnabled)
+    , std::make_tuple("Lookup Table",         &lookupTableEnabled)
+    , std::make_tuple("Fresnel",              &fresnelEnabled)
+    , std::make_tuple("Rim Light",            &rimLightEnabled)
+    , std::make_tuple("Blinn-Phong",          &blinnPhongEnabled)
+    , std::make_tuple("Sharpen",              &sharpenEnabled)
+    , std::make_tuple("Depth of Field",       &depthOfFieldEnabled)
+    , std::make_tuple("Painterly",            &painterlyEnabled)
+    , std::make_tuple("Motion Blur",          &motionBlurEnabled)
+    , std::make_tuple("Posterize",            &posterizeEnabled)
+    , std::make_tuple("Pixelize",             &pixelizeEnabled)
+    , std::make_tuple("Film Grain",           &filmGrainEnabled)
+    , std::make_tuple("Flow Maps",            &flowMapsEnabled)
+    , std::make_tuple("Chromatic Aberration", &chromaticAberrationEnabled)
+    , std::make_tuple("Deferred Lighting",    &deferredLightingEnabled)
+    };
+
+  CostMatrix costMatrixRun;
+  costMatrixRun.running = false;
+  if (costMatrix) {
+    setUpCostMatrix(costMatrixRun, effectToggles);
+  }
+  long long updateMicroseconds = 0;
+
+  FrameBudgetGovernor frameBudgetGovernor;
+  setUpFrameBudgetGovernor
+    ( frameBudgetGovernor
+    , frameBudgetGovernorEnabled
+    , frameBudget > 0
+        ? frameBudget
+        : (frameRateTarget > 0 ? 1000.0 / frameRateTarget : 0)
+    , frameBudgetShedOrder
+    , effectToggles
+    );
+
+  long long then          = monotonicMicroseconds();
+  long long loopStartedAt = then;
+  long long now           = then;
+  long long keyTime       = now;
 
   auto beforeFrame =
     [&]() -> void {
 
+    // In low latency mode, the input is read right after the wait so it's as fresh as it can be
+    // when the frame is drawn. Otherwise the wait comes after the update, just before drawing.
+    if (framePacer.lowLatency) {
+      paceFrame(framePacer, renderSuspension.suspended);
+    }
+
+    now = monotonicMicroseconds();
+
+    // Nobody sees the frames while the window is minimized or in the background
+    // so the buffers stop drawing and nothing updates until it comes back.
+
     WindowProperties windowProperties = graphicsWindow->get_properties();
-    if (windowProperties.get_minimized()) {
-      std::this_thread::sleep_for(std::chrono::seconds(1));
+    bool suspend =
+          windowProperties.get_minimized()
+      ||  (suspendWhenUnfocused && !windowProperties.get_foreground())
+      ;
+
+    if (suspend && !renderSuspension.suspended) {
+      renderSuspension.suspended = true;
+      stageChange
+        ( frameCommit
+        , [&]() -> void {
+            suspendRendering(renderSuspension, graphicsEngine, graphicsOutput);
+          }
+        );
+    } else if (!suspend && renderSuspension.suspended) {
+      renderSuspension.suspended = false;
+      stageChange
+        ( frameCommit
+        , [&]() -> void {
+            resumeRendering(renderSuspension);
+          }
+        );
     }
 
-    now = microsecondsSinceEpoch();
+    if (renderSuspension.suspended) {
+      commitFrame(frameCommit, graphicsEngine);
+
+      // Picks up where it left off rather than jumping ahead by however long it was away.
+      then = now;
+
+      return;
+    }
 
     // Avoids a loud audio pop.
     if (!soundStarted && microsecondToSecond(now - loopStartedAt) >= startSoundAt) {
@@ -1326,6 +2572,47 @@ int main
 
     double delta = microsecondToSecond(now - then);
 
+    recordFrameTime(frameTimes, now - then);
+
+    // The time spent waiting on the frame pacer isn't work so it's left out.
+    std::string governorStatus =
+      governFrameBudget
+        ( frameBudgetGovernor
+        , (now - then) - framePacer.waited
+        , now
+        );
+    if (!governorStatus.empty()) {
+      statusAlpha = 1.0;
+      statusText  = governorStatus;
+
+      // The status text fades, so a lasting note shows why the look changed.
+      printf("Frame budget governor: %s\n", governorStatus.c_str());
+    }
+
+    if (costMatrixRun.running) {
+      if (!stepCostMatrix(costMatrixRun, now - then, updateMicroseconds)) {
+        printCostMatrix(costMatrixRun);
+        framework.set_exit_flag();
+      }
+
+      // Each run starts the orbit over so they all draw the same frames.
+      if (costMatrixRun.frames == 0) { cameraRotateTheta = cameraRotateThetaInitial; }
+      cameraRotateTheta += 360.0 / (COST_MATRIX_WARMUP_FRAMES + COST_MATRIX_TRIAL_FRAMES);
+    }
+
+    if (autotuneTrial) {
+      autotuneFrames += 1;
+
+      // Only the frames after the warm up count.
+      if (autotuneFrames == AUTOTUNE_WARMUP_FRAMES) {
+        resetFrameTimes(frameTimes, FRAME_TIME_SAMPLES);
+      } else if (autotuneFrames >= AUTOTUNE_WARMUP_FRAMES + AUTOTUNE_TRIAL_FRAMES) {
+        framework.set_exit_flag();
+      }
+
+      cameraRotateTheta += 360.0 / (AUTOTUNE_WARMUP_FRAMES + AUTOTUNE_TRIAL_FRAMES);
+    }
+
     then = now;
 
     double movement = 100 * delta;
@@ -1340,6 +2627,7 @@ int main
     bool tabDown                 = isButtonDown(mouseWatcher, "tab");
 
     bool resetDown               = isButtonDown(mouseWatcher, "r");
+    bool frameTimesDown          = isButtonDown(mouseWatcher, "t");
 
     bool fogNearDown             = isButtonDown(mouseWatcher, "[");
     bool fogFarDown              = isButtonDown(mouseWatcher, "]");
@@ -1386,6 +2674,7 @@ int main
     bool flowMapsDown            = isButtonDown(mouseWatcher, ".");
     bool sunlightDown            = isButtonDown(mouseWatcher, "/");
     bool chromaticAberrationDown = isButtonDown(mouseWatcher, "\\");
+    bool deferredLightingDown    = isButtonDown(mouseWatcher, "g");
 
     bool mouseLeftDown    = mouseWatcher->is_button_down(MouseButton::one());
     bool mouseMiddleDown  = mouseWatcher->is_button_down(MouseButton::two());
@@ -1561,6 +2850,13 @@ int main
         statusText  = "Reset";
       }
 
+      if (frameTimesDown) {
+        keyTime = now;
+
+        statusAlpha = 1.0;
+        statusText  = "Frame " + formatFrameTimeStats(calculateFrameTimeStats(frameTimes));
+      }
+
       auto toggleStatus =
         [&](LVecBase2f enabled, std::string effect) -> void {
           statusAlpha = 1.0;
@@ -1826,6 +3122,16 @@ int main
           , "Chromatic Aberration"
           );
       }
+
+      if (deferredLightingDown) {
+        deferredLightingEnabled = toggleEnabledVec(deferredLightingEnabled);
+        keyTime = now;
+
+        toggleStatus
+          ( deferredLightingEnabled
+          , "Deferred Lighting"
+          );
+      }
     }
 
     if (flowMapsEnabled[0]) {
@@ -1881,89 +3187,180 @@ int main
 
     geometryNP0.set_shader_input("normalMapsEnabled", normalMapsEnabled);
     geometryNP0.set_shader_input("flowMapsEnabled",   flowMapsEnabled);
-    geometryCamera0->set_initial_state(geometryNP0.get_state());
+    stageInitialState(frameCommit, geometryCamera0, geometryNP0);
 
     geometryNP1.set_shader_input("normalMapsEnabled", normalMapsEnabled);
     geometryNP1.set_shader_input("flowMapsEnabled",   flowMapsEnabled);
-    geometryCamera1->set_initial_state(geometryNP1.get_state());
+    stageInitialState(frameCommit, geometryCamera1, geometryNP1);
 
     fogNP.set_shader_input("sunPosition",   LVecBase2f(sunlightP, 0));
     fogNP.set_shader_input("origin",        cameraNP.get_relative_point(render, environmentNP.get_pos()));
     fogNP.set_shader_input("nearFar",       LVecBase2f(fogNear, fogFar));
     fogNP.set_shader_input("enabled",       fogEnabled);
-    fogCamera->set_initial_state(fogNP.get_state());
 
     ssaoNP.set_shader_input("lensProjection", geometryCameraLens0->get_projection_mat());
     ssaoNP.set_shader_input("enabled",        ssaoEnabled);
-    ssaoCamera->set_initial_state(ssaoNP.get_state());
 
     refractionUvNP.set_shader_input("lensProjection", geometryCameraLens1->get_projection_mat());
     refractionUvNP.set_shader_input("enabled",        refractionEnabled);
     refractionUvNP.set_shader_input("rior",           rior);
-    refractionUvCamera->set_initial_state(refractionUvNP.get_state());
 
     reflectionUvNP.set_shader_input("lensProjection", geometryCameraLens1->get_projection_mat());
     reflectionUvNP.set_shader_input("enabled",        reflectionEnabled);
-    reflectionUvCamera->set_initial_state(reflectionUvNP.get_state());
+
+    if (planarReflection) {
+      planarReflectionSceneCameraNP.set_mat(cameraNP.get_mat(render) * waterMirror);
+      CPT(RenderState) planarReflectionSceneState = planarReflectionSceneNP.get_net_state();
+      if (planarReflectionSceneCamera->get_initial_state() != planarReflectionSceneState) {
+        stageChange
+          ( frameCommit
+          , [=]() -> void { planarReflectionSceneCamera->set_initial_state(planarReflectionSceneState); }
+          );
+      }
+
+      planarReflectionNP.set_shader_input("planeNormal", cameraNP.get_relative_vector(render, waterUp));
+      planarReflectionNP.set_shader_input("enabled",     reflectionEnabled);
+    }
 
     foamNP.set_shader_input("foamDepth",    foamDepth);
     foamNP.set_shader_input("viewWorldMat", currentViewWorldMat);
     foamNP.set_shader_input("sunPosition",  LVecBase2f(sunlightP, 0));
-    foamCamera->set_initial_state(foamNP.get_state());
 
     bloomNP.set_shader_input("enabled", bloomEnabled);
-    bloomCamera->set_initial_state(bloomNP.get_state());
+
+    for (FramebufferTexture& bloomFramebufferTexture : bloomDownsampleFramebufferTextures) {
+      bloomFramebufferTexture.buffer->set_active(bloomEnabled[0] == 1);
+    }
+    for (FramebufferTexture& bloomFramebufferTexture : bloomUpsampleFramebufferTextures) {
+      bloomFramebufferTexture.buffer->set_active(bloomEnabled[0] == 1);
+    }
+
+    // Dragging the window's edge changes its size every frame.
+    // Until it settles, the buffers keep their old size and the result is scaled to fit.
+    // The level of detail switch distances wait for it too.
+    if (updateResizeController(resizeController, graphicsOutput, now)) {
+      stageChange
+        ( frameCommit
+        , [&]() -> void {
+            resizeFramebufferTextures
+              ( graphicsOutput
+              , framebufferTextures
+              );
+          }
+        );
+
+      if (resizeController.ySize != levelOfDetailHeight) {
+        levelOfDetailHeight = resizeController.ySize;
+        setUpLevelsOfDetail(environmentNP, mainLens, levelOfDetailHeight);
+      }
+    }
 
     outlineNP.set_shader_input("enabled",             outlineEnabled);
-    outlineCamera->set_initial_state(outlineNP.get_state());
 
-    baseNP.set_shader_input("sunPosition",       LVecBase2f(sunlightP, 0));
+    render.set_shader_input("sunPosition", LVecBase2f(sunlightP, 0));
+    render.set_shader_input("origin",      cameraNP.get_relative_point(render, environmentNP.get_pos()));
+    render.set_shader_input("nearFar",     LVecBase2f(fogNear, fogFar));
+
     baseNP.set_shader_input("normalMapsEnabled", normalMapsEnabled);
     baseNP.set_shader_input("blinnPhongEnabled", blinnPhongEnabled);
     baseNP.set_shader_input("fresnelEnabled",    fresnelEnabled);
     baseNP.set_shader_input("rimLightEnabled",   rimLightEnabled);
     baseNP.set_shader_input("celShadingEnabled", celShadingEnabled);
     baseNP.set_shader_input("flowMapsEnabled",   flowMapsEnabled);
-    baseCamera->set_initial_state(baseNP.get_state());
+    setBaseCameraState();
+    // The key, the cost matrix, and the frame budget governor can all flip deferred lighting.
+    deferredLightingRegion->set_active(deferredLightingEnabled[0] == 1);
+
+    deferredLightingCameraNP.set_transform(cameraNP.get_transform(render));
+    deferredLightingRenderNP.set_attrib(render.get_attrib(LightAttrib::get_class_type()));
+    deferredLightingNP.set_shader_input("sunPosition",       LVecBase2f(sunlightP, 0));
+    deferredLightingNP.set_shader_input("blinnPhongEnabled", blinnPhongEnabled);
+    deferredLightingNP.set_shader_input("fresnelEnabled",    fresnelEnabled);
+    deferredLightingNP.set_shader_input("rimLightEnabled",   rimLightEnabled);
+    deferredLightingNP.set_shader_input("celShadingEnabled", celShadingEnabled);
 
     refractionNP.set_shader_input("sunPosition", LVecBase2f(sunlightP, 0));
-    refractionCamera->set_initial_state(refractionNP.get_state());
+
+    // With the water off-screen, the water passes only clear their buffers.
+    LVecBase4 waterDimensions = LVecBase4(0, 1, 0, 1);
+    bool      waterVisible    =
+         !waterHasBounds
+      || calculateScreenBounds
+           ( waterBoundsMin
+           , waterBoundsMax
+           , waterNP.get_mat(cameraNP)
+           , mainLens
+           , waterDimensions
+           );
+    if (waterHasBounds && waterVisible) {
+      PN_stdfloat marginX = (PN_stdfloat) WATER_SCISSOR_MARGIN / std::max(graphicsOutput->get_x_size(), 1);
+      PN_stdfloat marginY = (PN_stdfloat) WATER_SCISSOR_MARGIN / std::max(graphicsOutput->get_y_size(), 1);
+      waterDimensions =
+        LVecBase4
+          ( std::max(waterDimensions[0] - marginX, (PN_stdfloat) 0)
+          , std::min(waterDimensions[1] + marginX, (PN_stdfloat) 1)
+          , std::max(waterDimensions[2] - marginY, (PN_stdfloat) 0)
+          , std::min(waterDimensions[3] + marginY, (PN_stdfloat) 1)
+          );
+    }
+    for (PT(DisplayRegion) waterRegion : waterRegions) {
+      waterRegion->set_active(waterVisible);
+      waterRegion->set_dimensions(waterDimensions);
+    }
 
     sharpenNP.set_shader_input("enabled", sharpenEnabled);
-    sharpenCamera->set_initial_state(sharpenNP.get_state());
 
     sceneCombineNP.set_shader_input("sunPosition", LVecBase2f(sunlightP, 0));
-    sceneCombineCamera->set_initial_state(sceneCombineNP.get_state());
+
+    depthOfFieldTilesNP.set_shader_input("mouseFocusPoint", mouseFocusPoint);
+    depthOfFieldTilesBuffer->set_active(        depthOfFieldEnabled[0] == 1);
+    depthOfFieldNeighborTilesBuffer->set_active(depthOfFieldEnabled[0] == 1);
+
+    outOfFocusNP.set_shader_input("enabled", depthOfFieldEnabled);
+    outOfFocusBuffer->set_active(depthOfFieldEnabled[0] == 1);
 
     depthOfFieldNP.set_shader_input("mouseFocusPoint", mouseFocusPoint);
     depthOfFieldNP.set_shader_input("enabled",         depthOfFieldEnabled);
-    depthOfFieldCamera->set_initial_state(depthOfFieldNP.get_state());
 
     painterlyNP.set_shader_input("parameters", LVecBase2f(painterlyEnabled[0] == 1 ? 3 : 0, 0));
-    painterlyCamera->set_initial_state(painterlyNP.get_state());
 
-    motionBlurNP.set_shader_input("previousViewWorldMat",   previousViewWorldMat);
-    motionBlurNP.set_shader_input("worldViewMat",           render.get_transform(cameraNP)->get_mat());
-    motionBlurNP.set_shader_input("lensProjection",         geometryCameraLens1->get_projection_mat());
+    render.set_shader_input("previousWorldViewMat", invert(previousViewWorldMat));
+
+    updateMotionTrackedNodes(render, motionTrackedNodes);
+
+    velocityTilesBuffer->set_active(        motionBlurEnabled[0] == 1);
+    velocityNeighborTilesBuffer->set_active(motionBlurEnabled[0] == 1);
+
     motionBlurNP.set_shader_input("motionBlurEnabled",      motionBlurEnabled);
-    motionBlurCamera->set_initial_state(motionBlurNP.get_state());
 
     posterizeNP.set_shader_input("enabled", posterizeEnabled);
-    posterizeCamera->set_initial_state(posterizeNP.get_state());
 
     pixelizeNP.set_shader_input("enabled", pixelizeEnabled);
-    pixelizeCamera->set_initial_state(pixelizeNP.get_state());
 
     filmGrainNP.set_shader_input("enabled", filmGrainEnabled);
-    filmGrainCamera->set_initial_state(filmGrainNP.get_state());
 
-    lookupTableNP.set_shader_input("enabled",     lookupTableEnabled);
-    lookupTableNP.set_shader_input("sunPosition", LVecBase2f(sunlightP, 0));
-    lookupTableCamera->set_initial_state(lookupTableNP.get_state());
+    // Only rebake when the blend would change by at least one 8-bit step.
+    float lookupTableMix = 0.5 * (sin(sunlightP * TO_RAD) + 1.0);
+    if (lookupTableEnabled[0] == 1 && fabs(lookupTableMix - colorLookupTableMix) >= (1.0 / 255.0)) {
+      // The draw thread may still be uploading the last blend.
+      stageChange
+        ( frameCommit
+        , [=]() -> void {
+            blendLookupTableTextures
+              ( colorLookupTableTexture3d0
+              , colorLookupTableTexture3d1
+              , colorLookupTableTexture3d
+              , lookupTableMix
+              );
+          }
+        );
+      colorLookupTableMix = lookupTableMix;
+    }
+
+    lookupTableNP.set_shader_input("enabled", lookupTableEnabled);
 
     chromaticAberrationNP.set_shader_input("mouseFocusPoint", mouseFocusPoint);
     chromaticAberrationNP.set_shader_input("enabled",         chromaticAberrationEnabled);
-    chromaticAberrationCamera->set_initial_state(chromaticAberrationNP.get_state());
 
     previousViewWorldMat = currentViewWorldMat;
 
@@ -1975,13 +3372,28 @@ int main
     status->set_shadow_color(statusShadowColor);
     status->set_text(statusText);
 
-    updateAudoManager
-      ( sceneRootNP
+    // The sync point before cull.
+    // Whatever the simulation thread stepped during the last frame becomes visible now
+    // and the next step starts while this frame is culled and drawn.
+
+    if (syncSimulation(simulation)) {
+      updateSmokeParticles
+        ( smokeNP
+        , simulation.frames[simulation.front]
+        );
+    }
+
+    launchSimulation
+      ( simulation
+      , delta
+      , sceneRootNP
+      , smokeNP
       , cameraNP
       );
 
-    particleSystemManager.do_particles(delta);
-    physicsManager.do_physics(delta);
+    commitFrame(frameCommit, graphicsEngine);
+
+    updateMicroseconds = monotonicMicroseconds() - now;
     };
 
   auto beforeFrameRunner =
@@ -1999,6 +3411,30 @@ int main
         )
     );
 
+  auto beforeDraw =
+    [&]() -> void {
+    if (!framePacer.lowLatency) {
+      paceFrame(framePacer, renderSuspension.suspended);
+    }
+    };
+
+  auto beforeDrawRunner =
+    [](GenericAsyncTask* task, void* arg)
+      -> AsyncTask::DoneStatus {
+          (*static_cast<decltype(beforeDraw)*>(arg))();
+          return AsyncTask::DS_cont;
+      };
+
+  // Runs after the update but before the framework's render task at sort 50.
+  PT(GenericAsyncTask) beforeDrawTask =
+    new GenericAsyncTask
+      ( "beforeDraw"
+      , beforeDrawRunner
+      , &beforeDraw
+      );
+  beforeDrawTask->set_sort(49);
+  taskManager->add(beforeDrawTask);
+
   auto setMouseWheelUp =
     [&]() {
     mouseWheelUp = true;
@@ -2027,10 +3463,6 @@ int main
     , &setMouseWheelDown
     );
 
-  physicsManager.attach_linear_integrator
-    ( new LinearEulerIntegrator()
-    );
-
   LVector3f wheelNPRelPos = wheelNP.get_pos(sceneRootNP);
   sounds[0]->set_3d_attributes
     ( wheelNPRelPos[0]
@@ -2055,10 +3487,26 @@ int main
 
   framework.main_loop();
 
+  syncSimulation(simulation);
+
+  if (framePacer.interval > std::chrono::steady_clock::duration::zero() || framePacerReport) {
+    reportFramePacer(framePacer);
+  }
+
+  printf("Frame times  %s\n", formatFrameTimeStats(calculateFrameTimeStats(frameTimes)).c_str());
+
+  if (autotuneTrial) {
+    printf("Autotune p95 %.3f\n", calculateFrameTimeStats(frameTimes).p95);
+  }
+
   audioManager->shutdown();
 
+  stopSmokeParticleWorkers(smokeParticleWorkers);
+
   framework.close_framework();
 
+  unmountAssetArchive(assetArchive);
+
   return 0;
   }
 
@@ -2082,7 +3530,7 @@ void generateLights
 
   PT(DirectionalLight) sunlight = new DirectionalLight("sunlight");
   sunlight->set_color(sunlightColor1);
-  sunlight->set_shadow_caster(true, SHADOW_SIZE, SHADOW_SIZE);
+  sunlight->set_shadow_caster(true, quality.shadowSize, quality.shadowSize);
   sunlight->get_lens()->set_film_size(35, 35);
   sunlight->get_lens()->set_near_far(5.0, 35.0);
   if (showLights) sunlight->show_frustum();
@@ -2092,7 +3540,7 @@ void generateLights
 
   PT(DirectionalLight) moonlight = new DirectionalLight("moonlight");
   moonlight->set_color(moonlightColor1);
-  moonlight->set_shadow_caster(true, SHADOW_SIZE, SHADOW_SIZE);
+  moonlight->set_shadow_caster(true, quality.shadowSize, quality.shadowSize);
   moonlight->get_lens()->set_film_size(35, 35);
   moonlight->get_lens()->set_near_far(5.0, 35);
   if (showLights) moonlight->show_frustum();
@@ -2229,7 +3677,7 @@ float animateLights
   moonlight->set_color(lightColor * nightTimeLightMagnitude);
 
   if (dayTimeLightMagnitude > 0.0) {
-    sunlight->set_shadow_caster(true, SHADOW_SIZE, SHADOW_SIZE);
+    sunlight->set_shadow_caster(true, quality.shadowSize, quality.shadowSize);
     render.set_light(sunlightNP);
   } else {
     sunlight->set_shadow_caster(false, 0, 0);
@@ -2237,7 +3685,7 @@ float animateLights
   }
 
   if (nightTimeLightMagnitude > 0.0) {
-    moonlight->set_shadow_caster(true, SHADOW_SIZE, SHADOW_SIZE);
+    moonlight->set_shadow_caster(true, quality.shadowSize, quality.shadowSize);
     render.set_light(moonlightNP);
   } else {
     moonlight->set_shadow_caster(false, 0, 0);
@@ -2259,7 +3707,7 @@ float animateLights
       windowLight->set_shadow_caster(false, 0, 0);
       render.set_light_off(windowLightNP);
     } else {
-      windowLight->set_shadow_caster(true, SHADOW_SIZE, SHADOW_SIZE);
+      windowLight->set_shadow_caster(true, quality.shadowSize, quality.shadowSize);
       render.set_light(windowLightNP);
     }
     };
@@ -2284,12 +3732,97 @@ float animateLights
 PT(Shader) loadShader
   ( std::string vert
   , std::string frag
+  , std::string defines
   ) {
-  return Shader::load
+  Filename vertFilename = Filename("shaders/vertex/"   + vert + ".vert");
+  Filename fragFilename = Filename("shaders/fragment/" + frag + ".frag");
+
+  if (defines.empty()) {
+    return Shader::load
+      ( Shader::SL_GLSL
+      , vertFilename
+      , fragFilename
+      );
+  }
+
+  // The defines go right after the version line, ahead of the defaults in the source.
+
+  VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+  vfs->resolve_filename(vertFilename, get_model_path().get_value());
+  vfs->resolve_filename(fragFilename, get_model_path().get_value());
+
+  std::string vertSource = vfs->read_file(vertFilename, true);
+  std::string fragSource = vfs->read_file(fragFilename, true);
+
+  size_t vertVersionEnd = vertSource.find('\n', vertSource.find("#version"));
+  size_t fragVersionEnd = fragSource.find('\n', fragSource.find("#version"));
+  if (vertVersionEnd == std::string::npos || fragVersionEnd == std::string::npos) {
+    printf("Could not find the version line in %s or %s\n", vertFilename.c_str(), fragFilename.c_str());
+    return Shader::load(Shader::SL_GLSL, vertFilename, fragFilename);
+  }
+
+  vertSource.insert(vertVersionEnd + 1, defines);
+  fragSource.insert(fragVersionEnd + 1, defines);
+
+  return Shader::make
     ( Shader::SL_GLSL
-    , "shaders/vertex/"   + vert + ".vert"
-    , "shaders/fragment/" + frag + ".frag"
+    , vertSource
+    , fragSource
+    );
+  }
+
+QualityPreset loadQualityPreset
+  (
+  ) {
+  ConfigVariableString qualityPresetName
+    ( "quality-preset"
+    , DEFAULT_QUALITY_PRESET
+    , "One of low, medium, high, ultra, or custom."
     );
+
+  QualityPreset preset = QUALITY_PRESETS[0];
+  bool found = false;
+
+  // Custom starts from the default and takes everything else from the quality-* variables.
+  std::string name = qualityPresetName.get_value();
+  std::string base = name == "custom" ? DEFAULT_QUALITY_PRESET : name;
+
+  for (const QualityPreset& candidate : QUALITY_PRESETS) {
+    if (candidate.name == base) { preset = candidate; found = true; }
+  }
+
+  if (!found) {
+    printf("Unknown quality preset %s so using %s\n", name.c_str(), DEFAULT_QUALITY_PRESET.c_str());
+    for (const QualityPreset& candidate : QUALITY_PRESETS) {
+      if (candidate.name == DEFAULT_QUALITY_PRESET) { preset = candidate; }
+    }
+  }
+
+  preset.name = name;
+
+  ConfigVariableInt    ssaoSamples          ("quality-ssao-samples",            preset.ssaoSamples);
+  ConfigVariableInt    ssaoNoise            ("quality-ssao-noise",              preset.ssaoNoise);
+  ConfigVariableInt    shadowSize           ("quality-shadow-size",             preset.shadowSize);
+  ConfigVariableInt    reflectionBlurSize   ("quality-reflection-blur-size",    preset.reflectionBlurSize);
+  ConfigVariableInt    screenSpaceSteps     ("quality-screen-space-steps",      preset.screenSpaceSteps);
+  ConfigVariableDouble screenSpaceResolution("quality-screen-space-resolution", preset.screenSpaceResolution);
+  ConfigVariableInt    bloomLevels          ("quality-bloom-levels",            preset.bloomLevels);
+  ConfigVariableInt    depthOfFieldBlurSize ("quality-depth-of-field-blur-size", preset.depthOfFieldBlurSize);
+
+  // Anything below one would leave a pass with nothing to do.
+  preset.ssaoSamples           = std::max(1, (int) ssaoSamples);
+  preset.ssaoNoise             = std::max(1, (int) ssaoNoise);
+  preset.shadowSize            = std::max(1, (int) shadowSize);
+  preset.reflectionBlurSize    = std::max(0, (int) reflectionBlurSize);
+  preset.screenSpaceSteps      = std::max(1, (int) screenSpaceSteps);
+  preset.screenSpaceResolution = std::max(0.01, std::min(1.0, (double) screenSpaceResolution));
+  preset.bloomLevels           = std::max(2, (int) bloomLevels);
+  preset.depthOfFieldBlurSize  = std::max(0, (int) depthOfFieldBlurSize);
+
+  int noiseSide = (int) round(sqrt(preset.ssaoNoise));
+  preset.ssaoNoise = std::max(1, noiseSide * noiseSide);
+
+  return preset;
   }
 
 PTA_LVecBase3f generateSsaoSamples
@@ -2358,6 +3891,7 @@ FramebufferTexture generateFramebufferTexture
   bool                               setSrgbColor   = framebufferTextureArguments.setSrgbColor;
   bool                               setRgbColor    = framebufferTextureArguments.setRgbColor;
   bool                               useScene       = framebufferTextureArguments.useScene;
+  int                                sizeDivisor    = std::max(framebufferTextureArguments.sizeDivisor, 1);
   std::string                        name           = framebufferTextureArguments.name;
   LColor                             clearColor     = framebufferTextureArguments.clearColor;
 
@@ -2374,6 +3908,22 @@ FramebufferTexture generateFramebufferTexture
   fbp.set_srgb_color (setSrgbColor );
   fbp.set_rgb_color  (setRgbColor  );
 
+  // None of the buffers track the window's size on their own.
+  // Otherwise every one of them would be reallocated on every step of a drag-resize.
+  // They're all resized at once by resizeFramebufferTextures instead.
+
+  int flags =
+      GraphicsPipe::BF_refuse_window
+    | GraphicsPipe::BF_resizeable
+    | GraphicsPipe::BF_can_bind_every
+    | GraphicsPipe::BF_rtt_cumulative;
+
+  WindowProperties windowProperties =
+    WindowProperties::size
+      ( std::max(graphicsOutput->get_x_size() / sizeDivisor, 1)
+      , std::max(graphicsOutput->get_y_size() / sizeDivisor, 1)
+      );
+
   PT(GraphicsOutput) buffer =
     graphicsEngine
       ->make_output
@@ -2381,12 +3931,8 @@ FramebufferTexture generateFramebufferTexture
         , name + "Buffer"
         , BACKGROUND_RENDER_SORT_ORDER - 1
         , fbp
-        , WindowProperties::size(0, 0),
-            GraphicsPipe::BF_refuse_window
-          | GraphicsPipe::BF_resizeable
-          | GraphicsPipe::BF_can_bind_every
-          | GraphicsPipe::BF_rtt_cumulative
-          | GraphicsPipe::BF_size_track_host
+        , windowProperties
+        , flags
         , graphicsOutput->get_gsg()
         , graphicsOutput->get_host()
         );
@@ -2420,16 +3966,21 @@ FramebufferTexture generateFramebufferTexture
 
   NodePath shaderNP = NodePath(name + "Shader");
 
+  // A full screen pass keeps its shader and inputs on a node above the card
+  // rather than in the camera's initial state.
+  // Nodes are pipeline cycled so beforeFrame can change the inputs while the last frame is still being drawn.
+
   if (!useScene) {
     NodePath renderNP = NodePath(name + "Render");
     renderNP.set_depth_test( false);
     renderNP.set_depth_write(false);
     cameraNP.reparent_to(renderNP);
+    shaderNP.reparent_to(renderNP);
     CardMaker card = CardMaker(name);
     card.set_frame_fullscreen_quad();
     card.set_has_uvs(true);
     NodePath cardNP = NodePath(card.generate());
-    cardNP.reparent_to(renderNP);
+    cardNP.reparent_to(shaderNP);
     cardNP.set_pos(0, 0, 0);
     cardNP.set_hpr(0, 0, 0);
     cameraNP.look_at(cardNP);
@@ -2441,9 +3992,66 @@ FramebufferTexture generateFramebufferTexture
   result.camera       = camera;
   result.cameraNP     = cameraNP;
   result.shaderNP     = shaderNP;
+  result.sizeDivisor  = sizeDivisor;
+
+  if (framebufferTextureArguments.framebufferTextures != nullptr) {
+    framebufferTextureArguments.framebufferTextures->push_back(result);
+  }
+
   return result;
   }
 
+void setUpResizeController
+  ( ResizeController& controller
+  , PT(GraphicsOutput) graphicsOutput
+  ) {
+  controller.xSize     = graphicsOutput->get_x_size();
+  controller.ySize     = graphicsOutput->get_y_size();
+  controller.changedAt = 0;
+  controller.pending   = false;
+  }
+
+bool updateResizeController
+  ( ResizeController& controller
+  , PT(GraphicsOutput) graphicsOutput
+  , long long now
+  ) {
+  // Each new size restarts the wait so a drag only resizes the buffers once it's over.
+
+  int xSize = graphicsOutput->get_x_size();
+  int ySize = graphicsOutput->get_y_size();
+
+  if (xSize != controller.xSize || ySize != controller.ySize) {
+    controller.xSize     = xSize;
+    controller.ySize     = ySize;
+    controller.changedAt = now;
+    controller.pending   = true;
+    return false;
+  }
+
+  if (!controller.pending || now - controller.changedAt < RESIZE_DEBOUNCE_MICROSECONDS) { return false; }
+
+  controller.pending = false;
+
+  return true;
+  }
+
+void resizeFramebufferTextures
+  ( PT(GraphicsOutput) graphicsOutput
+  , std::vector<FramebufferTexture>& framebufferTextures
+  ) {
+  for (FramebufferTexture& framebufferTexture : framebufferTextures) {
+    int xSize = std::max(graphicsOutput->get_x_size() / framebufferTexture.sizeDivisor, 1);
+    int ySize = std::max(graphicsOutput->get_y_size() / framebufferTexture.sizeDivisor, 1);
+
+    if  (   framebufferTexture.buffer->get_x_size() == xSize
+        &&  framebufferTexture.buffer->get_y_size() == ySize
+        ) { continue; }
+
+    framebufferTexture.buffer->set_size(xSize, ySize);
+  }
+  }
+
 void showBuffer
   ( NodePath render2d
   , NodePath statusNP
@@ -2479,12 +4087,13 @@ void hideBuffer
     nodePath.detach_node();
   }
 
-int microsecondsSinceEpoch
+long long monotonicMicroseconds
   (
   ) {
+  // The steady clock never jumps with the wall clock and 64 bits of microseconds never run out.
   return std::chrono::duration_cast
     <std::chrono::microseconds>
-      ( std::chrono::system_clock::now().time_since_epoch()
+      ( std::chrono::steady_clock::now().time_since_epoch()
       ).count();
   }
 
@@ -2532,13 +4141,12 @@ void setSoundState
   }
 
 void updateAudoManager
-  ( NodePath sceneRootNP
-  , NodePath cameraNP
+  ( const SimulationFrame& frame
   ) {
-  LVector3f f = sceneRootNP.get_relative_vector(cameraNP, LVector3f::forward());
-  LVector3f u = sceneRootNP.get_relative_vector(cameraNP, LVector3f::up());
+  LVector3f f = frame.listenerForward;
+  LVector3f u = frame.listenerUp;
   LVector3f v = LVector3f(0, 0, 0);
-  LVector3f p = cameraNP.get_pos(sceneRootNP);
+  LVector3f p = frame.listenerPosition;
 
   audioManager->audio_3d_set_listener_attributes
     ( p[0], p[1], p[2]
@@ -2581,15 +4189,19 @@ LVecBase3f calculateCameraLookAt
 NodePath setUpParticles
   ( NodePath render
   , PT(Texture) smokeTexture
+  , ParticleSystemManager& particleSystemManager
+  , PhysicsManager& physicsManager
+  , int poolSize
+  , int litterSize
   ) {
   PT(ParticleSystem) smokePS = new ParticleSystem();
   PT(ForceNode)      smokeFN = new ForceNode("smoke");
   PT(PhysicalNode)   smokePN = new PhysicalNode("smoke");
 
-  smokePS->set_pool_size(75);
+  smokePS->set_pool_size(poolSize);
   smokePS->set_birth_rate(0.01);
-  smokePS->set_litter_size(1);
-  smokePS->set_litter_spread(2);
+  smokePS->set_litter_size(litterSize);
+  smokePS->set_litter_spread(std::max(2, litterSize / 4));
   smokePS->set_system_lifespan(0.0);
   smokePS->set_local_velocity_flag(true);
   smokePS->set_system_grows_older_flag(false);
@@ -2670,40 +4282,2539 @@ NodePath setUpParticles
   return smokeNP;
   }
 
-void squashGeometry
-  ( NodePath environmentNP
+NodePath setUpSmokeParticles
+  ( NodePath render
+  , PT(Texture) smokeTexture
   ) {
-  for (int i = 0; i < 4; ++i) {
-    std::string index = std::to_string(i);
-    NodePathCollection treeCollection = environmentNP.find_all_matches("**/tree" + index);
-    NodePath treesNP = NodePath("treeCollection" + index);
-    treesNP.reparent_to(environmentNP);
-    treeCollection.reparent_to(treesNP);
-    treesNP.flatten_strong();
-  }
+  // The first array holds the four corners of the quad.
+  // The second array advances once per instance and holds each particle.
+  // The vertices all sit at the origin so anything drawing this without
+  // the particle vertex shader only sees degenerate triangles.
+
+  PT(GeomVertexArrayFormat) cornerArrayFormat = new GeomVertexArrayFormat();
+  cornerArrayFormat->add_column
+    ( InternalName::get_vertex()
+    , 3
+    , Geom::NT_float32
+    , Geom::C_point
+    );
+  cornerArrayFormat->add_column
+    ( InternalName::get_texcoord()
+    , 2
+    , Geom::NT_float32
+    , Geom::C_texcoord
+    );
 
-  NodePathCollection barrelCollection = environmentNP.find_all_matches("**/barrel-wood*");
-  NodePath barrelNP = NodePath("barrels");
-  barrelNP.reparent_to(environmentNP);
-  barrelCollection.reparent_to(barrelNP);
-  barrelNP.flatten_strong();
+  PT(GeomVertexArrayFormat) instanceArrayFormat = new GeomVertexArrayFormat();
+  instanceArrayFormat->add_column
+    ( InternalName::make("offset")
+    , 4
+    , Geom::NT_float32
+    , Geom::C_other
+    );
+  instanceArrayFormat->add_column
+    ( InternalName::make("particleColor")
+    , 4
+    , Geom::NT_float32
+    , Geom::C_other
+    );
+  instanceArrayFormat->set_divisor(1);
+
+  PT(GeomVertexFormat) smokeFormat = new GeomVertexFormat();
+  smokeFormat->add_array(cornerArrayFormat);
+  smokeFormat->add_array(instanceArrayFormat);
+
+  PT(GeomVertexData) smokeVertexData =
+    new GeomVertexData
+      ( "smoke"
+      , GeomVertexFormat::register_format(smokeFormat)
+      , Geom::UH_static
+      );
+
+  GeomVertexWriter vertexWriter(  smokeVertexData, InternalName::get_vertex());
+  GeomVertexWriter texcoordWriter(smokeVertexData, InternalName::get_texcoord());
+  GeomVertexWriter offsetWriter(  smokeVertexData, "offset");
+  GeomVertexWriter colorWriter(   smokeVertexData, "particleColor");
+
+  for (int i = 0; i < 4; ++i) {
+    vertexWriter.add_data3f(0, 0, 0);
+    texcoordWriter.add_data2f(i % 2, i / 2);
+  }
+
+  offsetWriter.add_data4f(0, 0, 0, 0);
+  colorWriter.add_data4f( 0, 0, 0, 0);
+
+  smokeVertexData->modify_array(1)->set_usage_hint(Geom::UH_stream);
+
+  PT(GeomTriangles) smokeTriangles = new GeomTriangles(Geom::UH_static);
+  smokeTriangles->add_vertices(0, 1, 2);
+  smokeTriangles->add_vertices(2, 1, 3);
+
+  PT(Geom) smokeGeom = new Geom(smokeVertexData);
+  smokeGeom->add_primitive(smokeTriangles);
+  smokeGeom->set_bounds(new OmniBoundingVolume());
+
+  PT(GeomNode) smokeGN = new GeomNode("smoke");
+  smokeGN->add_geom(smokeGeom);
+  smokeGN->set_bounds(new OmniBoundingVolume());
+  smokeGN->set_final(true);
+
+  NodePath smokeNP = render.attach_new_node(smokeGN);
+
+  smokeNP.set_pos(0.47, 4.5, 8.9);
+  smokeNP.set_texture(smokeTexture);
+  smokeNP.set_transparency(TransparencyAttrib::M_dual);
+  smokeNP.set_bin("fixed", 0);
+  smokeNP.set_instance_count(1);
+
+  return smokeNP;
+  }
+
+void resetSmokeParticles
+  ( SmokeParticles& particles
+  , int poolSize
+  , int litterSize
+  , int numberOfWorkers
+  ) {
+  // Leave room to finish the last batch of four without reading past the end.
+  int capacity = poolSize + 4;
+
+  particles.positionX.assign(capacity, 0);
+  particles.positionY.assign(capacity, 0);
+  particles.positionZ.assign(capacity, 0);
+  particles.velocityX.assign(capacity, 0);
+  particles.velocityY.assign(capacity, 0);
+  particles.velocityZ.assign(capacity, 0);
+  particles.age.assign(      capacity, 0);
+  particles.lifespan.assign( capacity, 1);
+
+  particles.depthKeys.assign(    capacity, 0);
+  particles.depthKeysSwap.assign(capacity, 0);
+  particles.order.assign(        capacity, 0);
+  particles.orderSwap.assign(    capacity, 0);
+
+  particles.seeds.resize(numberOfWorkers);
+  for (int i = 0; i < numberOfWorkers; ++i) {
+    particles.seeds[i] = 2463534242u + i * 7919u;
+  }
+
+  particles.poolSize   = poolSize;
+  particles.litterSize = litterSize;
+  particles.count      = 0;
+  particles.birthTime  = 0;
+  }
+
+void updateSmokeParticles
+  ( NodePath smokeNP
+  , const SimulationFrame& frame
+  ) {
+  PT(GeomNode)            smokeGN         = DCAST(GeomNode, smokeNP.node());
+  PT(Geom)                smokeGeom       = smokeGN->modify_geom(0);
+  PT(GeomVertexData)      smokeVertexData = smokeGeom->modify_vertex_data();
+  PT(GeomVertexArrayData) instanceArray   = smokeVertexData->modify_array(1);
+
+  // Instancing zero times would draw it once so an empty pool draws one invisible particle.
+
+  int numberOfInstances = std::max(1, frame.smokeInstanceCount);
+
+  PT(GeomVertexArrayDataHandle) instanceHandle = instanceArray->modify_handle();
+  instanceHandle->unclean_set_num_rows(numberOfInstances);
+
+  float* instanceData = (float*) instanceHandle->get_write_pointer();
+
+  if (frame.smokeInstanceCount == 0) {
+    std::fill(instanceData, instanceData + SMOKE_PARTICLE_INSTANCE_FLOATS, 0.0f);
+  } else {
+    std::memcpy
+      ( instanceData
+      , frame.smokeInstances.data()
+      , frame.smokeInstanceCount * SMOKE_PARTICLE_INSTANCE_FLOATS * sizeof(float)
+      );
+  }
+
+  smokeNP.set_instance_count(numberOfInstances);
+  }
+
+void emitSmokeParticles
+  ( SmokeParticles& particles
+  , float delta
+  ) {
+  // Swap the dead with the last living particle to keep the living packed at the front.
+
+  for (int i = 0; i < particles.count;) {
+    if (particles.age[i] < particles.lifespan[i]) { ++i; continue; }
+
+    int last = --particles.count;
+
+    particles.positionX[i] = particles.positionX[last];
+    particles.positionY[i] = particles.positionY[last];
+    particles.positionZ[i] = particles.positionZ[last];
+    particles.velocityX[i] = particles.velocityX[last];
+    particles.velocityY[i] = particles.velocityY[last];
+    particles.velocityZ[i] = particles.velocityZ[last];
+    particles.age[i]       = particles.age[last];
+    particles.lifespan[i]  = particles.lifespan[last];
+  }
+
+  int litterSpread = std::max(2, particles.litterSize / 4);
+
+  particles.birthTime += delta;
+
+  while (particles.birthTime >= SMOKE_PARTICLE_BIRTH_RATE) {
+    particles.birthTime -= SMOKE_PARTICLE_BIRTH_RATE;
+
+    int litterSize =
+        particles.litterSize
+      + (int) std::round((randomFloats(generator) * 2.0 - 1.0) * litterSpread);
+
+    for (int i = 0; i < litterSize && particles.count < particles.poolSize; ++i) {
+      float lifespan =
+          SMOKE_PARTICLE_LIFESPAN_BASE
+        + (randomFloats(generator) * 2.0 - 1.0)
+        * SMOKE_PARTICLE_LIFESPAN_SPREAD;
+
+      // These would die as soon as they're born.
+      if (lifespan <= 0.0) { continue; }
+
+      float launch = (randomFloats(generator) * 2.0 - 1.0) * SMOKE_PARTICLE_LAUNCH_SPEED;
+
+      int j = particles.count++;
+
+      particles.positionX[j] = 0;
+      particles.positionY[j] = 0;
+      particles.positionZ[j] = 0;
+      particles.velocityX[j] = 0;
+      particles.velocityY[j] = launch;
+      particles.velocityZ[j] = SMOKE_PARTICLE_OFFSET_SPEED;
+      particles.age[j]       = 0;
+      particles.lifespan[j]  = lifespan;
+    }
+  }
+  }
+
+void simulateSmokeParticles
+  ( SmokeParticles& particles
+  , SmokeParticleWorkers& workers
+  , float delta
+  , LVecBase3f cameraPosition
+  , LVecBase3f cameraDirection
+  , float* instanceData
+  ) {
+  int count = particles.count;
+
+  // Keep each range a multiple of four so only the last one has a remainder.
+  auto range =
+    [count](int worker, int numberOfWorkers, int& begin, int& end) -> void {
+      int size = (((count + numberOfWorkers - 1) / numberOfWorkers) + 3) & ~3;
+      begin    = std::min(count, worker * size);
+      end      = std::min(count, begin  + size);
+    };
+
+  runSmokeParticleWorkers
+    ( workers
+    , [&](int worker, int numberOfWorkers) -> void {
+        int begin, end;
+        range(worker, numberOfWorkers, begin, end);
+
+        simulateSmokeParticleRange
+          ( particles
+          , begin
+          , end
+          , delta
+          , cameraPosition
+          , cameraDirection
+          , particles.seeds[worker]
+          );
+      }
+    );
+
+  sortSmokeParticles(particles);
+
+  runSmokeParticleWorkers
+    ( workers
+    , [&](int worker, int numberOfWorkers) -> void {
+        int begin, end;
+        range(worker, numberOfWorkers, begin, end);
+
+        writeSmokeParticleRange
+          ( particles
+          , begin
+          , end
+          , instanceData
+          );
+      }
+    );
+  }
+
+void simulateSmokeParticleRange
+  ( SmokeParticles& particles
+  , int begin
+  , int end
+  , float delta
+  , LVecBase3f cameraPosition
+  , LVecBase3f cameraDirection
+  , unsigned int& seed
+  ) {
+  // The forces match the original LinearVectorForce, LinearJitterForce,
+  // and LinearCylinderVortexForce integrated with Euler's method.
+
+  float* positionX = particles.positionX.data();
+  float* positionY = particles.positionY.data();
+  float* positionZ = particles.positionZ.data();
+  float* velocityX = particles.velocityX.data();
+  float* velocityY = particles.velocityY.data();
+  float* velocityZ = particles.velocityZ.data();
+  float* age       = particles.age.data();
+
+  unsigned int* depthKeys = particles.depthKeys.data();
+
+  const float vortexRadius2 = SMOKE_PARTICLE_VORTEX_RADIUS * SMOKE_PARTICLE_VORTEX_RADIUS;
+  const float epsilon       = 0.000001;
+
+  int i = begin;
+
+#if defined(__SSE2__)
+  const __m128 deltaV        = _mm_set1_ps(delta);
+  const __m128 zeroV         = _mm_setzero_ps();
+  const __m128 oneV          = _mm_set1_ps(1.0);
+  const __m128 epsilonV      = _mm_set1_ps(epsilon);
+  const __m128 forceXV       = _mm_set1_ps(SMOKE_PARTICLE_FORCE_X);
+  const __m128 forceYV       = _mm_set1_ps(SMOKE_PARTICLE_FORCE_Y);
+  const __m128 jitterV       = _mm_set1_ps(SMOKE_PARTICLE_JITTER);
+  const __m128 vortexLengthV = _mm_set1_ps(SMOKE_PARTICLE_VORTEX_LENGTH);
+  const __m128 vortexRadiusV = _mm_set1_ps(vortexRadius2);
+  const __m128 vortexCoefV   = _mm_set1_ps(SMOKE_PARTICLE_VORTEX_COEFFICIENT / std::sqrt(2.0));
+  const __m128 terminalV     = _mm_set1_ps(SMOKE_PARTICLE_TERMINAL_VELOCITY);
+  const __m128 cameraXV      = _mm_set1_ps(cameraPosition[0]);
+  const __m128 cameraYV      = _mm_set1_ps(cameraPosition[1]);
+  const __m128 cameraZV      = _mm_set1_ps(cameraPosition[2]);
+  const __m128 directionXV   = _mm_set1_ps(cameraDirection[0]);
+  const __m128 directionYV   = _mm_set1_ps(cameraDirection[1]);
+  const __m128 directionZV   = _mm_set1_ps(cameraDirection[2]);
+  const __m128i signBitV     = _mm_set1_epi32(0x80000000);
+
+  for (; i + 4 <= end; i += 4) {
+    __m128 x  = _mm_loadu_ps(positionX + i);
+    __m128 y  = _mm_loadu_ps(positionY + i);
+    __m128 z  = _mm_loadu_ps(positionZ + i);
+    __m128 vx = _mm_loadu_ps(velocityX + i);
+    __m128 vy = _mm_loadu_ps(velocityY + i);
+    __m128 vz = _mm_loadu_ps(velocityZ + i);
+
+    float jitter[12];
+    for (int j = 0; j < 12; ++j) { jitter[j] = randomSmokeJitter(seed); }
+
+    __m128 jx = _mm_loadu_ps(jitter);
+    __m128 jy = _mm_loadu_ps(jitter + 4);
+    __m128 jz = _mm_loadu_ps(jitter + 8);
+
+    __m128 jitterLength2 =
+      _mm_add_ps
+        ( _mm_add_ps(_mm_mul_ps(jx, jx), _mm_mul_ps(jy, jy))
+        , _mm_mul_ps(jz, jz)
+        );
+    __m128 jitterScale =
+      _mm_div_ps(jitterV, _mm_sqrt_ps(_mm_max_ps(jitterLength2, epsilonV)));
+
+    __m128 ax = _mm_add_ps(forceXV, _mm_mul_ps(jx, jitterScale));
+    __m128 ay = _mm_add_ps(forceYV, _mm_mul_ps(jy, jitterScale));
+    __m128 az =                     _mm_mul_ps(jz, jitterScale);
+
+    // The vortex pushes along the sum of the tangent and the pull toward the axis,
+    // scaled by the particle's speed, but only inside the cylinder.
+
+    __m128 radius2 = _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+    __m128 speed   =
+      _mm_sqrt_ps
+        ( _mm_add_ps
+            ( _mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy))
+            , _mm_mul_ps(vz, vz)
+            )
+        );
+    __m128 inside =
+      _mm_and_ps
+        ( _mm_and_ps(_mm_cmpge_ps(z, zeroV), _mm_cmple_ps(z, vortexLengthV))
+        , _mm_and_ps(_mm_cmple_ps(radius2, vortexRadiusV), _mm_cmpgt_ps(radius2, epsilonV))
+        );
+    __m128 vortexScale =
+      _mm_and_ps
+        ( inside
+        , _mm_div_ps
+            ( _mm_mul_ps(vortexCoefV, speed)
+            , _mm_sqrt_ps(_mm_max_ps(radius2, epsilonV))
+            )
+        );
+
+    ax = _mm_add_ps(ax, _mm_mul_ps(_mm_sub_ps(y, x), vortexScale));
+    ay = _mm_sub_ps(ay, _mm_mul_ps(_mm_add_ps(x, y), vortexScale));
+
+    vx = _mm_add_ps(vx, _mm_mul_ps(ax, deltaV));
+    vy = _mm_add_ps(vy, _mm_mul_ps(ay, deltaV));
+    vz = _mm_add_ps(vz, _mm_mul_ps(az, deltaV));
+
+    __m128 speed2 =
+      _mm_add_ps
+        ( _mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy))
+        , _mm_mul_ps(vz, vz)
+        );
+    __m128 terminalScale =
+      _mm_min_ps
+        ( oneV
+        , _mm_div_ps(terminalV, _mm_sqrt_ps(_mm_max_ps(speed2, epsilonV)))
+        );
+
+    vx = _mm_mul_ps(vx, terminalScale);
+    vy = _mm_mul_ps(vy, terminalScale);
+    vz = _mm_mul_ps(vz, terminalScale);
+
+    x = _mm_add_ps(x, _mm_mul_ps(vx, deltaV));
+    y = _mm_add_ps(y, _mm_mul_ps(vy, deltaV));
+    z = _mm_add_ps(z, _mm_mul_ps(vz, deltaV));
+
+    // Flip the float bits so the keys sort as unsigned integers, farthest first.
+
+    __m128 depth =
+      _mm_add_ps
+        ( _mm_add_ps
+            ( _mm_mul_ps(_mm_sub_ps(x, cameraXV), directionXV)
+            , _mm_mul_ps(_mm_sub_ps(y, cameraYV), directionYV)
+            )
+        , _mm_mul_ps(_mm_sub_ps(z, cameraZV), directionZV)
+        );
+    __m128i depthBits = _mm_castps_si128(depth);
+    __m128i depthKey  =
+      _mm_xor_si128
+        ( depthBits
+        , _mm_or_si128(_mm_srai_epi32(depthBits, 31), signBitV)
+        );
+
+    _mm_storeu_si128((__m128i*) (depthKeys + i), _mm_xor_si128(depthKey, _mm_set1_epi32(-1)));
+
+    _mm_storeu_ps(positionX + i, x);
+    _mm_storeu_ps(positionY + i, y);
+    _mm_storeu_ps(positionZ + i, z);
+    _mm_storeu_ps(velocityX + i, vx);
+    _mm_storeu_ps(velocityY + i, vy);
+    _mm_storeu_ps(velocityZ + i, vz);
+    _mm_storeu_ps(age       + i, _mm_add_ps(_mm_loadu_ps(age + i), deltaV));
+  }
+#endif
+
+  for (; i < end; ++i) {
+    float x  = positionX[i];
+    float y  = positionY[i];
+    float z  = positionZ[i];
+    float vx = velocityX[i];
+    float vy = velocityY[i];
+    float vz = velocityZ[i];
+
+    float jx = randomSmokeJitter(seed);
+    float jy = randomSmokeJitter(seed);
+    float jz = randomSmokeJitter(seed);
+
+    float jitterScale = SMOKE_PARTICLE_JITTER / std::sqrt(std::max(jx * jx + jy * jy + jz * jz, epsilon));
+
+    float ax = SMOKE_PARTICLE_FORCE_X + jx * jitterScale;
+    float ay = SMOKE_PARTICLE_FORCE_Y + jy * jitterScale;
+    float az =                          jz * jitterScale;
+
+    float radius2 = x * x + y * y;
+
+    if  (   z >= 0.0
+        &&  z <= SMOKE_PARTICLE_VORTEX_LENGTH
+        &&  radius2 <= vortexRadius2
+        &&  radius2 >  epsilon
+        ) {
+      float speed       = std::sqrt(vx * vx + vy * vy + vz * vz);
+      float vortexScale =
+          (SMOKE_PARTICLE_VORTEX_COEFFICIENT / std::sqrt(2.0))
+        * speed
+        / std::sqrt(radius2);
+
+      ax += (y - x) * vortexScale;
+      ay -= (x + y) * vortexScale;
+    }
+
+    vx += ax * delta;
+    vy += ay * delta;
+    vz += az * delta;
+
+    float terminalScale =
+      std::min
+        ( 1.0f
+        , SMOKE_PARTICLE_TERMINAL_VELOCITY
+        / std::sqrt(std::max(vx * vx + vy * vy + vz * vz, epsilon))
+        );
+
+    vx *= terminalScale;
+    vy *= terminalScale;
+    vz *= terminalScale;
+
+    x += vx * delta;
+    y += vy * delta;
+    z += vz * delta;
+
+    float depth =
+        (x - cameraPosition[0]) * cameraDirection[0]
+      + (y - cameraPosition[1]) * cameraDirection[1]
+      + (z - cameraPosition[2]) * cameraDirection[2];
+
+    unsigned int depthBits;
+    memcpy(&depthBits, &depth, sizeof(depthBits));
+    depthKeys[i] = ~(depthBits ^ ((depthBits >> 31) ? 0xFFFFFFFF : 0x80000000));
+
+    positionX[i] = x;
+    positionY[i] = y;
+    positionZ[i] = z;
+    velocityX[i] = vx;
+    velocityY[i] = vy;
+    velocityZ[i] = vz;
+    age[i]      += delta;
+  }
+  }
+
+void sortSmokeParticles
+  ( SmokeParticles& particles
+  ) {
+  // A least significant digit radix sort, one byte per pass, so the cost grows
+  // linearly with the number of particles.
+
+  int count = particles.count;
+
+  for (int i = 0; i < count; ++i) { particles.order[i] = i; }
+
+  for (int shift = 0; shift < 32; shift += 8) {
+    int counts[256] = { 0 };
+
+    for (int i = 0; i < count; ++i) {
+      counts[(particles.depthKeys[i] >> shift) & 0xFF] += 1;
+    }
+
+    // Every key shares this byte so the pass wouldn't move anything.
+    if (count == 0 || counts[(particles.depthKeys[0] >> shift) & 0xFF] == count) { continue; }
+
+    int offsets[256];
+    int offset = 0;
+    for (int j = 0; j < 256; ++j) {
+      offsets[j]  = offset;
+      offset     += counts[j];
+    }
+
+    for (int i = 0; i < count; ++i) {
+      unsigned int key = particles.depthKeys[i];
+      int          j   = offsets[(key >> shift) & 0xFF]++;
+
+      particles.depthKeysSwap[j] = key;
+      particles.orderSwap[j]     = particles.order[i];
+    }
+
+    particles.depthKeys.swap(particles.depthKeysSwap);
+    particles.order.swap(    particles.orderSwap);
+  }
+  }
+
+void writeSmokeParticleRange
+  ( SmokeParticles& particles
+  , int begin
+  , int end
+  , float* instanceData
+  ) {
+  // Each particle grows and darkens over its life while fading out.
+
+  for (int k = begin; k < end; ++k) {
+    int   i     = particles.order[k];
+    float t     = std::min(1.0f, std::max(0.0f, particles.age[i] / particles.lifespan[i]));
+    float alpha = 1.0 - t;
+          alpha = alpha * alpha * (3.0 - 2.0 * alpha);
+
+    float* instance = instanceData + k * SMOKE_PARTICLE_INSTANCE_FLOATS;
+
+    instance[0] = particles.positionX[i];
+    instance[1] = particles.positionY[i];
+    instance[2] = particles.positionZ[i];
+    instance[3] = SMOKE_PARTICLE_SIZE * t;
+    instance[4] = 1.0 + (SMOKE_PARTICLE_END_COLOR[0] - 1.0) * t;
+    instance[5] = 1.0 + (SMOKE_PARTICLE_END_COLOR[1] - 1.0) * t;
+    instance[6] = 1.0 + (SMOKE_PARTICLE_END_COLOR[2] - 1.0) * t;
+    instance[7] = SMOKE_PARTICLE_ALPHA * alpha;
+  }
+  }
+
+float randomSmokeJitter
+  ( unsigned int& seed
+  ) {
+  // A xorshift generator per worker avoids sharing the global generator across threads.
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return (seed & 0xFFFFFF) / float(0xFFFFFF) * 2.0 - 1.0;
+  }
+
+void benchmarkSmokeParticles
+  ( PT(Texture) smokeTexture
+  ) {
+  // Steps both simulators at a fixed rate for the same pool sizes and reports the time per step.
+
+  const int   steps = 600;
+  const float delta = 1.0 / 60.0;
+
+  for (int poolSize : { 75, 1024, 8192, SMOKE_PARTICLE_POOL_SIZE }) {
+    int litterSize = std::max(1, poolSize * SMOKE_PARTICLE_LITTER_SIZE / SMOKE_PARTICLE_POOL_SIZE);
+
+    ParticleSystemManager particleSystemManager;
+    PhysicsManager        physicsManager;
+    physicsManager.attach_linear_integrator(new LinearEulerIntegrator());
+
+    NodePath benchmarkNP = NodePath("benchmark");
+    NodePath pandaNP     =
+      setUpParticles
+        ( benchmarkNP
+        , smokeTexture
+        , particleSystemManager
+        , physicsManager
+        , poolSize
+        , litterSize
+        );
+
+    FrameTimes pandaTimes;
+    resetFrameTimes(pandaTimes, steps);
+
+    double pandaAlive = 0;
+    auto   pandaStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < steps; ++i) {
+      long long stepStart = monotonicMicroseconds();
+      particleSystemManager.do_particles(delta);
+      physicsManager.do_physics(delta);
+      recordFrameTime(pandaTimes, monotonicMicroseconds() - stepStart);
+      pandaAlive += DCAST(ParticleSystem, DCAST(PhysicalNode, pandaNP.node())->get_physical(0))->get_living_particles();
+    }
+    auto pandaEnd = std::chrono::steady_clock::now();
+
+    SmokeParticles particles;
+    resetSmokeParticles
+      ( particles
+      , poolSize
+      , litterSize
+      , smokeParticleWorkers.threads.size() + 1
+      );
+    std::vector<float> instanceData(poolSize * SMOKE_PARTICLE_INSTANCE_FLOATS);
+
+    FrameTimes smokeTimes;
+    resetFrameTimes(smokeTimes, steps);
+
+    double smokeAlive = 0;
+    auto   smokeStart = std::chrono::steady_clock::now();
+    for (int i = 0; i < steps; ++i) {
+      long long stepStart = monotonicMicroseconds();
+      emitSmokeParticles(particles, delta);
+      simulateSmokeParticles
+        ( particles
+        , smokeParticleWorkers
+        , delta
+        , LVecBase3f(0, -20, 0)
+        , LVecBase3f(0,   1, 0)
+        , instanceData.data()
+        );
+      recordFrameTime(smokeTimes, monotonicMicroseconds() - stepStart);
+      smokeAlive += particles.count;
+    }
+    auto smokeEnd = std::chrono::steady_clock::now();
+
+    double pandaMs = std::chrono::duration<double, std::milli>(pandaEnd - pandaStart).count() / steps;
+    double smokeMs = std::chrono::duration<double, std::milli>(smokeEnd - smokeStart).count() / steps;
+
+    printf
+      ( "Pool %6d  Panda %8.3f ms per step (%7.0f alive)  Smoke %8.3f ms per step (%7.0f alive)\n"
+      , poolSize
+      , pandaMs
+      , pandaAlive / steps
+      , smokeMs
+      , smokeAlive / steps
+      );
+    printf("            Panda %s\n", formatFrameTimeStats(calculateFrameTimeStats(pandaTimes)).c_str());
+    printf("            Smoke %s\n", formatFrameTimeStats(calculateFrameTimeStats(smokeTimes)).c_str());
+
+    particleSystemManager.remove_particlesystem
+      ( DCAST(ParticleSystem, DCAST(PhysicalNode, pandaNP.node())->get_physical(0))
+      );
+  }
+  }
+
+void startSmokeParticleWorkers
+  ( SmokeParticleWorkers& workers
+  , int numberOfWorkers
+  ) {
+  // The calling thread is always worker zero so only the rest get threads.
+
+  workers.generation = 0;
+  workers.remaining  = 0;
+  workers.stop       = false;
+
+  for (int worker = 1; worker < numberOfWorkers; ++worker) {
+    workers.threads.push_back
+      ( std::thread
+          ( [&workers, worker, numberOfWorkers]() -> void {
+              int generation = 0;
+
+              while (true) {
+                std::function<void(int, int)> job;
+
+                {
+                  std::unique_lock<std::mutex> lock(workers.mutex);
+                  workers.startCondition.wait
+                    ( lock
+                    , [&]() { return workers.stop || workers.generation != generation; }
+                    );
+                  if (workers.stop) { return; }
+                  generation = workers.generation;
+                  job        = workers.job;
+                }
+
+                job(worker, numberOfWorkers);
+
+                {
+                  std::lock_guard<std::mutex> lock(workers.mutex);
+                  workers.remaining -= 1;
+                }
+                workers.doneCondition.notify_one();
+              }
+            }
+          )
+      );
+  }
+  }
+
+void runSmokeParticleWorkers
+  ( SmokeParticleWorkers& workers
+  , std::function<void(int, int)> job
+  ) {
+  int numberOfWorkers = workers.threads.size() + 1;
+
+  if (numberOfWorkers == 1) { job(0, 1); return; }
+
+  {
+    std::lock_guard<std::mutex> lock(workers.mutex);
+    workers.job        = job;
+    workers.remaining  = numberOfWorkers - 1;
+    workers.generation += 1;
+  }
+  workers.startCondition.notify_all();
+
+  job(0, numberOfWorkers);
+
+  std::unique_lock<std::mutex> lock(workers.mutex);
+  workers.doneCondition.wait
+    ( lock
+    , [&]() { return workers.remaining == 0; }
+    );
+  }
+
+void stopSmokeParticleWorkers
+  ( SmokeParticleWorkers& workers
+  ) {
+  {
+    std::lock_guard<std::mutex> lock(workers.mutex);
+    workers.stop = true;
+  }
+  workers.startCondition.notify_all();
+
+  for (std::thread& thread : workers.threads) { thread.join(); }
+
+  workers.threads.clear();
+  }
+
+void setUpSimulation
+  ( Simulation& simulation
+  , SmokeParticles& smokeParticles
+  , SmokeParticleWorkers& smokeParticleWorkers
+  ) {
+  for (SimulationFrame& frame : simulation.frames) {
+    frame.delta              = 0;
+    frame.smokeInstanceCount = 0;
+    frame.smokeInstances.assign(smokeParticles.poolSize * SMOKE_PARTICLE_INSTANCE_FLOATS, 0.0f);
+  }
+
+  simulation.front                = 0;
+  simulation.smokeParticles       = &smokeParticles;
+  simulation.smokeParticleWorkers = &smokeParticleWorkers;
+  simulation.task                 = nullptr;
+
+  // One thread is enough since the smoke step fans out to its own workers.
+
+  simulation.taskChain = taskManager->make_task_chain("simulation");
+  simulation.taskChain->set_num_threads(1);
+  simulation.taskChain->set_frame_sync(false);
+  }
+
+void launchSimulation
+  ( Simulation& simulation
+  , float delta
+  , NodePath sceneRootNP
+  , NodePath smokeNP
+  , NodePath cameraNP
+  ) {
+  // Everything the step needs from the scene graph is copied here, on the main thread,
+  // so the simulation thread never reads a node while it's being culled.
+
+  SimulationFrame& frame = simulation.frames[1 - simulation.front];
+
+  frame.delta            = delta;
+  frame.cameraPosition   = cameraNP.get_pos(smokeNP);
+  frame.cameraDirection  = smokeNP.get_relative_vector(cameraNP, LVector3f(0, 1, 0));
+  frame.listenerPosition = cameraNP.get_pos(sceneRootNP);
+  frame.listenerForward  = sceneRootNP.get_relative_vector(cameraNP, LVector3f::forward());
+  frame.listenerUp       = sceneRootNP.get_relative_vector(cameraNP, LVector3f::up());
+
+  simulation.task =
+    new GenericAsyncTask
+      ( "simulation"
+      , [](GenericAsyncTask* task, void* arg)
+          -> AsyncTask::DoneStatus {
+              stepSimulation(*static_cast<Simulation*>(arg));
+              return AsyncTask::DS_done;
+          }
+      , &simulation
+      );
+  simulation.task->set_task_chain("simulation");
+
+  taskManager->add(simulation.task);
+  }
+
+void stepSimulation
+  ( Simulation& simulation
+  ) {
+  // Runs on the simulation thread and only ever touches the back frame.
+
+  SimulationFrame& frame     = simulation.frames[1 - simulation.front];
+  SmokeParticles&  particles = *simulation.smokeParticles;
+
+  emitSmokeParticles(particles, frame.delta);
+
+  simulateSmokeParticles
+    ( particles
+    , *simulation.smokeParticleWorkers
+    , frame.delta
+    , frame.cameraPosition
+    , frame.cameraDirection
+    , frame.smokeInstances.data()
+    );
+
+  frame.smokeInstanceCount = particles.count;
+
+  updateAudoManager(frame);
+  }
+
+bool syncSimulation
+  ( Simulation& simulation
+  ) {
+  if (simulation.task == nullptr) { return false; }
+
+  simulation.task->wait();
+  simulation.task = nullptr;
+
+  // The back frame is finished so it becomes the front.
+
+  simulation.front = 1 - simulation.front;
+
+  return true;
+  }
+
+void stageInitialState
+  ( FrameCommit& commit
+  , PT(Camera) camera
+  , NodePath shaderNP
+  ) {
+  // States are unique so an unchanged one is the same pointer and costs no sync.
+  CPT(RenderState) state = shaderNP.get_state();
+  if (camera->get_initial_state() == state) { return; }
+  commit.changes.push_back([=]() -> void { camera->set_initial_state(state); });
+  }
+
+void stageTagState
+  ( FrameCommit& commit
+  , PT(Camera) camera
+  , std::string tag
+  , CPT(RenderState) state
+  ) {
+  if (camera->has_tag_state(tag) && camera->get_tag_state(tag) == state) { return; }
+  commit.changes.push_back([=]() -> void { camera->set_tag_state(tag, state); });
+  }
+
+void stageChange
+  ( FrameCommit& commit
+  , std::function<void()> change
+  ) {
+  commit.changes.push_back(change);
+  }
+
+void commitFrame
+  ( FrameCommit& commit
+  , PT(GraphicsEngine) graphicsEngine
+  ) {
+  if (commit.changes.empty()) { return; }
+
+  // Camera states, buffer sizes and RAM images live outside of Panda's pipeline cycler,
+  // so they can only change once the cull and draw threads are done with the last frame.
+  // Everything else the app touches in the scene graph is cycled and safe as is.
+  // Only toggles, resizes and lookup table blends get staged,
+  // so most frames return above and never wait.
+
+  graphicsEngine->sync_frame();
+
+  for (std::function<void()>& change : commit.changes) { change(); }
+
+  commit.changes.clear();
+  }
+
+void setUpFramePacer
+  ( FramePacer& pacer
+  , int targetRate
+  , bool lowLatency
+  ) {
+  pacer.interval =
+    targetRate > 0
+      ? std::chrono::duration_cast<std::chrono::steady_clock::duration>
+          ( std::chrono::duration<double>(1.0 / targetRate)
+          )
+      : std::chrono::steady_clock::duration::zero();
+  pacer.deadline    = std::chrono::steady_clock::now();
+  pacer.lowLatency  = lowLatency;
+  pacer.frames      = 0;
+  pacer.jitterTotal = 0;
+  pacer.jitterMax   = 0;
+  pacer.lateFrames  = 0;
+  pacer.waited      = 0;
+  }
+
+void paceFrame
+  ( FramePacer& pacer
+  , bool idle
+  ) {
+  // When idle, nobody sees the frames so only enough are drawn to keep up with the window events.
+  std::chrono::steady_clock::duration interval =
+    idle
+      ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(FRAME_PACER_MINIMIZED_INTERVAL)
+      : pacer.interval;
+
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+  if (interval <= std::chrono::steady_clock::duration::zero()) {
+    pacer.deadline = now;
+    pacer.waited   = 0;
+    return;
+  }
+
+  // The deadlines advance by whole intervals so the small errors don't add up.
+  // A frame more than an interval late starts over from now rather than rushing to catch up.
+  // Its lateness still counts against the deadline it missed.
+  pacer.deadline += interval;
+  std::chrono::steady_clock::time_point missedDeadline = pacer.deadline;
+  if (pacer.deadline + interval < now) { pacer.deadline = now; }
+
+  while (true) {
+    std::chrono::steady_clock::duration remaining = pacer.deadline - std::chrono::steady_clock::now();
+    if (remaining <= std::chrono::steady_clock::duration::zero()) { break; }
+
+    if (remaining > FRAME_PACER_SPIN_TIME) {
+      std::this_thread::sleep_for(remaining - FRAME_PACER_SPIN_TIME);
+    } else {
+#if defined(__SSE2__)
+      _mm_pause();
+#endif
+    }
+  }
+
+  pacer.waited =
+    std::chrono::duration_cast<std::chrono::microseconds>
+      ( std::chrono::steady_clock::now() - now
+      ).count();
+
+  if (idle) { return; }
+
+  // The jitter is how far from its deadline the frame actually got going.
+  double jitter =
+    std::chrono::duration<double, std::milli>
+      ( std::chrono::steady_clock::now() - missedDeadline
+      ).count();
+
+  if (now > missedDeadline) { pacer.lateFrames += 1; }
+
+  pacer.frames      += 1;
+  pacer.jitterTotal += jitter;
+  pacer.jitterMax    = std::max(pacer.jitterMax, jitter);
+  }
+
+void reportFramePacer
+  ( FramePacer& pacer
+  ) {
+  if (pacer.frames == 0) {
+    printf("Frame pacing off\n");
+    return;
+  }
+
+  printf
+    ( "Frame pacing %8.3f ms target\n"
+      "Jitter mean  %8.3f ms\n"
+      "Jitter max   %8.3f ms\n"
+      "Late frames  %ld of %ld\n"
+    , std::chrono::duration<double, std::milli>(pacer.interval).count()
+    , pacer.jitterTotal / pacer.frames
+    , pacer.jitterMax
+    , pacer.lateFrames
+    , pacer.frames
+    );
+  }
+
+void setUpFrameBudgetGovernor
+  ( FrameBudgetGovernor& governor
+  , bool enabled
+  , double budget
+  , std::string shedOrder
+  , std::vector<std::tuple<std::string, LVecBase2f*>> effects
+  ) {
+  governor.enabled   = enabled && budget > 0;
+  governor.budget    = budget;
+  governor.changedAt = 0;
+  governor.order.clear();
+  governor.shed.clear();
+
+  resetFrameTimes(governor.busyTimes, FRAME_BUDGET_WINDOW);
+
+  // The order is a comma separated list of the effect names as they appear in the status text.
+  std::stringstream names(shedOrder);
+  std::string name;
+  while (std::getline(names, name, ',')) {
+    name.erase(0, name.find_first_not_of(" \t"));
+    name.erase(name.find_last_not_of(" \t") + 1);
+    if (name.empty()) { continue; }
+
+    auto effect =
+      std::find_if
+        ( effects.begin()
+        , effects.end()
+        , [&](std::tuple<std::string, LVecBase2f*>& candidate) { return std::get<0>(candidate) == name; }
+        );
+
+    if (effect == effects.end()) {
+      printf("Unknown effect %s in frame-budget-shed-order\n", name.c_str());
+      continue;
+    }
+
+    governor.order.push_back(*effect);
+  }
+  }
+
+std::string governFrameBudget
+  ( FrameBudgetGovernor& governor
+  , long long busyMicroseconds
+  , long long now
+  ) {
+  // Returns the status to show when it turns an effect off or back on.
+
+  if (!governor.enabled) { return ""; }
+
+  // Anything turned back on by hand is no longer the governor's to restore.
+  governor.shed.erase
+    ( std::remove_if
+        ( governor.shed.begin()
+        , governor.shed.end()
+        , [&](int i) { return (*std::get<1>(governor.order[i]))[0] == 1; }
+        )
+    , governor.shed.end()
+    );
+
+  recordFrameTime(governor.busyTimes, busyMicroseconds);
+  if (governor.busyTimes.count.load() < FRAME_BUDGET_WINDOW) { return ""; }
+
+  double busy = calculateFrameTimeStats(governor.busyTimes).p95;
+
+  std::string status = "";
+
+  if (busy > governor.budget) {
+    for (int i = 0; i < governor.order.size(); ++i) {
+      LVecBase2f* enabled = std::get<1>(governor.order[i]);
+      if ((*enabled)[0] != 1) { continue; }
+
+      *enabled = makeEnabledVec(0);
+      governor.shed.push_back(i);
+      status = std::get<0>(governor.order[i]) + " Off Over Budget";
+      break;
+    }
+  } else if
+      (  busy < governor.budget * FRAME_BUDGET_RESTORE_FACTOR
+      && now - governor.changedAt >= FRAME_BUDGET_RESTORE_MICROSECONDS
+      && !governor.shed.empty()
+      ) {
+    // The last one turned off is the first one back on.
+    int i = governor.shed.back();
+    governor.shed.pop_back();
+
+    *std::get<1>(governor.order[i]) = makeEnabledVec(1);
+    status = std::get<0>(governor.order[i]) + " On Under Budget";
+  }
+
+  // Each change gets a fresh window so it's judged on the frames drawn after it.
+  if (!status.empty()) {
+    governor.changedAt = now;
+    resetFrameTimes(governor.busyTimes, FRAME_BUDGET_WINDOW);
+  }
+
+  return status;
+  }
+
+void resetFrameTimes
+  ( FrameTimes& times
+  , int size
+  ) {
+  times.samples = std::vector<std::atomic<long long>>(std::max(size, 1));
+  times.count.store(0);
+  }
+
+void recordFrameTime
+  ( FrameTimes& times
+  , long long microseconds
+  ) {
+  // Once the ring is full, each new sample replaces the oldest.
+  long long count = times.count.load(std::memory_order_relaxed);
+  times.samples[count % times.samples.size()].store(microseconds, std::memory_order_relaxed);
+  times.count.store(count + 1, std::memory_order_release);
+  }
+
+FrameTimeStats calculateFrameTimeStats
+  ( const FrameTimes& times
+  ) {
+  FrameTimeStats stats = { 0, 0, 0, 0, 0 };
+
+  long long count = times.count.load(std::memory_order_acquire);
+  long long size  = std::min(count, (long long) times.samples.size());
+  if (size == 0) { return stats; }
+
+  std::vector<long long> samples(size);
+  for (long long i = 0; i < size; ++i) {
+    samples[i] = times.samples[i].load(std::memory_order_relaxed);
+  }
+  std::sort(samples.begin(), samples.end());
+
+  auto percentile =
+    [&](double p) -> double {
+      long long index = std::max(0LL, (long long) ceil(p * size) - 1);
+      return samples[std::min(index, size - 1)] / 1000.0;
+    };
+
+  stats.p50   = percentile(0.50);
+  stats.p95   = percentile(0.95);
+  stats.p99   = percentile(0.99);
+  stats.max   = samples[size - 1] / 1000.0;
+  stats.count = size;
+
+  return stats;
+  }
+
+void setUpCostMatrix
+  ( CostMatrix& matrix
+  , std::vector<std::tuple<std::string, LVecBase2f*>> effects
+  ) {
+  matrix.running  = !effects.empty();
+  matrix.effect   = 0;
+  matrix.effectOn = true;
+  matrix.frames   = 0;
+
+  resetFrameTimes(matrix.frameTimes,  COST_MATRIX_TRIAL_FRAMES);
+  resetFrameTimes(matrix.updateTimes, COST_MATRIX_TRIAL_FRAMES);
+
+  matrix.effects.clear();
+  matrix.defaults.clear();
+
+  for (std::tuple<std::string, LVecBase2f*>& effect : effects) {
+    EffectCost cost;
+    cost.name      = std::get<0>(effect);
+    cost.enabled   = std::get<1>(effect);
+    cost.frameOn   = 0;
+    cost.frameOff  = 0;
+    cost.updateOn  = 0;
+    cost.updateOff = 0;
+    matrix.effects.push_back(cost);
+    matrix.defaults.push_back(*cost.enabled);
+  }
+
+  if (matrix.running) { *matrix.effects[0].enabled = makeEnabledVec(1); }
+  }
+
+bool stepCostMatrix
+  ( CostMatrix& matrix
+  , long long frameMicroseconds
+  , long long updateMicroseconds
+  ) {
+  // Returns false once every effect has been measured.
+
+  matrix.frames += 1;
+
+  if (matrix.frames > COST_MATRIX_WARMUP_FRAMES) {
+    recordFrameTime(matrix.frameTimes,  frameMicroseconds);
+    recordFrameTime(matrix.updateTimes, updateMicroseconds);
+  }
+
+  if (matrix.frames < COST_MATRIX_WARMUP_FRAMES + COST_MATRIX_TRIAL_FRAMES) { return true; }
+
+  EffectCost& cost = matrix.effects[matrix.effect];
+
+  double frame  = calculateFrameTimeStats(matrix.frameTimes ).p50;
+  double update = calculateFrameTimeStats(matrix.updateTimes).p50;
+
+  if (matrix.effectOn) {
+    cost.frameOn  = frame;
+    cost.updateOn = update;
+  } else {
+    cost.frameOff  = frame;
+    cost.updateOff = update;
+  }
+
+  matrix.frames = 0;
+  resetFrameTimes(matrix.frameTimes,  COST_MATRIX_TRIAL_FRAMES);
+  resetFrameTimes(matrix.updateTimes, COST_MATRIX_TRIAL_FRAMES);
+
+  for (int i = 0; i < matrix.effects.size(); ++i) {
+    *matrix.effects[i].enabled = matrix.defaults[i];
+  }
+
+  if (matrix.effectOn) {
+    matrix.effectOn = false;
+  } else {
+    matrix.effectOn = true;
+    matrix.effect  += 1;
+  }
+
+  if (matrix.effect >= matrix.effects.size()) {
+    matrix.running = false;
+    return false;
+  }
+
+  // Everything else stays at its default while one effect is measured.
+  *matrix.effects[matrix.effect].enabled = makeEnabledVec(matrix.effectOn ? 1 : 0);
+
+  return true;
+  }
+
+void printCostMatrix
+  ( CostMatrix& matrix
+  ) {
+  // The frame times are the median time between frames so they cover the CPU and GPU together.
+  // The update times are the median time the CPU spent preparing each frame.
+  // Most effects keep their passes drawing and only switch their shader off,
+  // so the GPU time of a single pass isn't broken out.
+
+  printf("Only the whole frame is timed. The costs include every pass an effect touches.\n\n");
+
+  printf
+    ( "%-22s %9s %9s %9s %9s %9s %9s\n"
+    , "Effect"
+    , "Frame On"
+    , "Off"
+    , "Cost"
+    , "Update On"
+    , "Off"
+    , "Cost"
+    );
+
+  for (EffectCost& cost : matrix.effects) {
+    printf
+      ( "%-22s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n"
+      , cost.name.c_str()
+      , cost.frameOn
+      , cost.frameOff
+      , cost.frameOn  - cost.frameOff
+      , cost.updateOn
+      , cost.updateOff
+      , cost.updateOn - cost.updateOff
+      );
+  }
+  }
+
+int autotuneQuality
+  ( std::string executable
+  ) {
+  // Each candidate runs in its own process since the pipeline is built once at startup.
+  // The best preset that fits the budget is picked first.
+  // Then its shadow size, SSAO samples, and screen space resolution are each raised while they still fit.
+
+  ConfigVariableDouble frameBudget
+    ( "autotune-frame-budget"
+    , 16.6
+    , "The 95th percentile frame time in milliseconds the autotuner has to stay under."
+    );
+
+  auto fits =
+    [&](QualityPreset candidate) -> bool {
+      double p95 = runAutotuneTrial(executable, candidate);
+      printf
+        ( "%-8s shadow %5d  ssao %3d  resolution %4.2f  p95 %8.3f ms %s\n"
+        , candidate.name.c_str()
+        , candidate.shadowSize
+        , candidate.ssaoSamples
+        , candidate.screenSpaceResolution
+        , p95
+        , p95 >= 0 && p95 <= frameBudget ? "fits" : "over"
+        );
+      return p95 >= 0 && p95 <= frameBudget;
+    };
+
+  QualityPreset chosen = QUALITY_PRESETS.front();
+  bool          anyFit = false;
+  for (int i = QUALITY_PRESETS.size() - 1; i >= 0; --i) {
+    if (fits(QUALITY_PRESETS[i])) { chosen = QUALITY_PRESETS[i]; anyFit = true; break; }
+  }
+
+  // The resolution steps up to the next whole tenth.
+  // Counting in tenths keeps float drift from stepping just past full resolution.
+  auto raiseResolution =
+    [](QualityPreset& p) -> bool {
+      int tenths = (int) floor(p.screenSpaceResolution * 10 + 0.0001) + 1;
+      p.screenSpaceResolution = tenths / 10.0;
+      return tenths <= 10;
+    };
+
+  std::vector<std::function<bool(QualityPreset&)>> raises =
+    { [](QualityPreset& p) -> bool { p.shadowSize *= 2;  return p.shadowSize  <= 8192; }
+    , [](QualityPreset& p) -> bool { p.ssaoSamples *= 2; return p.ssaoSamples <= 64;   }
+    , raiseResolution
+    };
+
+  if (anyFit) {
+    for (std::function<bool(QualityPreset&)>& raise : raises) {
+      QualityPreset candidate = chosen;
+      while (raise(candidate) && fits(candidate)) { chosen = candidate; }
+    }
+  } else {
+    printf
+      ( "No preset met the %.1f ms budget so %s is written anyway, as the fastest one.\n"
+      , (double) frameBudget
+      , chosen.name.c_str()
+      );
+  }
+
+  std::ofstream autotunePrc(AUTOTUNE_PRC_PATH.c_str());
+  if (!autotunePrc) {
+    printf("Could not write %s\n", AUTOTUNE_PRC_PATH.c_str());
+    return 1;
+  }
+
+  autotunePrc
+    << "# Written by --autotune for a frame budget of " << frameBudget << " ms.\n"
+    << (anyFit ? "" : "# Nothing met the budget so this is the fastest preset.\n")
+    << "quality-preset                  " << chosen.name                  << "\n"
+    << "quality-shadow-size             " << chosen.shadowSize            << "\n"
+    << "quality-ssao-samples            " << chosen.ssaoSamples           << "\n"
+    << "quality-screen-space-resolution " << chosen.screenSpaceResolution << "\n";
+
+  printf("Wrote %s\n", AUTOTUNE_PRC_PATH.c_str());
+
+  return 0;
+  }
+
+double runAutotuneTrial
+  ( std::string executable
+  , QualityPreset candidate
+  ) {
+  char command[1024];
+  snprintf
+    ( command
+    , sizeof(command)
+    , "\"%s\" --autotune-trial %s %d %d %f"
+    , executable.c_str()
+    , candidate.name.c_str()
+    , candidate.shadowSize
+    , candidate.ssaoSamples
+    , candidate.screenSpaceResolution
+    );
+
+  FILE* trial = popen(command, "r");
+  if (trial == nullptr) { return -1; }
+
+  double p95 = -1;
+  char   line[256];
+  while (fgets(line, sizeof(line), trial) != nullptr) {
+    sscanf(line, "Autotune p95 %lf", &p95);
+  }
+
+  if (pclose(trial) != 0) { return -1; }
+
+  return p95;
+  }
+
+std::string formatFrameTimeStats
+  ( FrameTimeStats stats
+  ) {
+  char text[128];
+  snprintf
+    ( text
+    , sizeof(text)
+    , "p50 %.2f p95 %.2f p99 %.2f max %.2f ms"
+    , stats.p50
+    , stats.p95
+    , stats.p99
+    , stats.max
+    );
+
+  return std::string(text);
+  }
+
+void suspendRendering
+  ( RenderSuspension& suspension
+  , PT(GraphicsEngine) graphicsEngine
+  , PT(GraphicsOutput) graphicsOutput
+  ) {
+  // Every buffer the engine knows about, including the ones behind the shadow casting lights,
+  // is switched off but kept as is. Only the ones that were on come back on.
+
+  suspension.outputs.clear();
+
+  for (int i = 0; i < graphicsEngine->get_num_windows(); ++i) {
+    PT(GraphicsOutput) output = graphicsEngine->get_window(i);
+    if (output == graphicsOutput || !output->is_active()) { continue; }
+
+    output->set_active(false);
+    suspension.outputs.push_back(output);
+  }
+  }
+
+void resumeRendering
+  ( RenderSuspension& suspension
+  ) {
+  for (PT(GraphicsOutput)& output : suspension.outputs) {
+    output->set_active(true);
+  }
+
+  suspension.outputs.clear();
+  }
+
+void squashGeometry
+  ( NodePath environmentNP
+  ) {
+  // Copies of the same tree or barrel are drawn as instances of one mesh
+  // rather than flattened together into ever more unique geometry.
+
+  NodePath instancesNP = NodePath("instances");
+  instancesNP.reparent_to(environmentNP);
+
+  for (int i = 0; i < 4; ++i) {
+    instanceRepeatedGeometry
+      ( environmentNP
+      , instancesNP
+      , environmentNP.find_all_matches("**/tree" + std::to_string(i))
+      );
+  }
+
+  instanceRepeatedGeometry
+    ( environmentNP
+    , instancesNP
+    , environmentNP.find_all_matches("**/barrel-wood*")
+    );
+
+  NodePath squashNP = NodePath("squash");
+  squashNP.reparent_to(environmentNP);
+
+  NodePathCollection squashCollection = environmentNP.find_all_matches("**/*");
+  for (int i = 0; i < squashCollection.size(); ++i) {
+    if  (   squashCollection[i].get_name() == "wheel-lp"
+        ||  squashCollection[i].get_name() == "water-lp"
+        ||  squashCollection[i].get_name() == "squash"
+        ||  squashCollection[i].get_name() == "instances"
+        ||  instancesNP.is_ancestor_of(squashCollection[i])
+        ) { continue; }
+    squashCollection[i].reparent_to(squashNP);
+  }
+
+  // Flattening all of it into one node would leave one bounding volume no camera could ever cull.
+  // Instead the scene is split into a grid of cells and each cell is flattened on its own,
+  // merging the geometry that shares a state within it.
+
+  LPoint3 sceneMin;
+  LPoint3 sceneMax;
+  if (!squashNP.calc_tight_bounds(sceneMin, sceneMax)) {
+    squashNP.flatten_strong();
+    return;
+  }
+
+  LVecBase3 cellSize = (sceneMax - sceneMin) / SCENE_CLUSTER_GRID_SIZE;
+  cellSize[0] = std::max(cellSize[0], (PN_stdfloat) 0.001);
+  cellSize[1] = std::max(cellSize[1], (PN_stdfloat) 0.001);
+
+  NodePathCollection squashChildren = squashNP.get_children();
+
+  std::vector<NodePath> clusterNPs;
+  for (int i = 0; i < SCENE_CLUSTER_GRID_SIZE * SCENE_CLUSTER_GRID_SIZE; ++i) {
+    clusterNPs.push_back(squashNP.attach_new_node("cluster" + std::to_string(i)));
+  }
+
+  // Whatever spans more than a couple of cells would stretch any cell it landed in.
+  NodePath largeClusterNP = squashNP.attach_new_node("clusterLarge");
+  clusterNPs.push_back(largeClusterNP);
+
+  for (int i = 0; i < squashChildren.size(); ++i) {
+    NodePath childNP = squashChildren[i];
+
+    LPoint3 childMin;
+    LPoint3 childMax;
+    if (!childNP.calc_tight_bounds(childMin, childMax, squashNP)) {
+      childNP.reparent_to(largeClusterNP);
+      continue;
+    }
+
+    LVecBase3 childSize = childMax - childMin;
+    if  (   childSize[0] > SCENE_CLUSTER_MAX_CELLS * cellSize[0]
+        ||  childSize[1] > SCENE_CLUSTER_MAX_CELLS * cellSize[1]
+        ) {
+      childNP.reparent_to(largeClusterNP);
+      continue;
+    }
+
+    LPoint3 childCenter = (childMin + childMax) * 0.5;
+
+    int x = (childCenter[0] - sceneMin[0]) / cellSize[0];
+    int y = (childCenter[1] - sceneMin[1]) / cellSize[1];
+    x = std::max(0, std::min(SCENE_CLUSTER_GRID_SIZE - 1, x));
+    y = std::max(0, std::min(SCENE_CLUSTER_GRID_SIZE - 1, y));
+
+    childNP.reparent_to(clusterNPs[y * SCENE_CLUSTER_GRID_SIZE + x]);
+  }
+
+  for (NodePath& clusterNP : clusterNPs) {
+    if (clusterNP.get_num_children() == 0) {
+      clusterNP.remove_node();
+      continue;
+    }
+
+    clusterNP.flatten_strong();
+
+    addLevelsOfDetail(clusterNP);
+  }
+  }
+
+void instanceRepeatedGeometry
+  ( NodePath environmentNP
+  , NodePath instancesNP
+  , NodePathCollection propCollection
+  ) {
+  std::map<std::string, std::vector<NodePath>> propGroups;
+  std::vector<std::string> signatures;
+
+  for (int i = 0; i < propCollection.size(); ++i) {
+    NodePath propNP = propCollection[i];
+
+    // Flattening an earlier match may have already taken this one with it.
+    if (!environmentNP.is_ancestor_of(propNP)) { continue; }
+
+    // The shader only knows how to rotate, scale uniformly, and move.
+    CPT(TransformState) transform = propNP.get_transform(environmentNP);
+    if (!transform->has_uniform_scale() || transform->has_nonzero_shear()) { continue; }
+
+    // Bake whatever sits below the prop into its own space so equal props have equal vertices.
+    // The prop's own transform is set aside first or it would be baked in too,
+    // leaving every copy with different vertices and no offset to instance with.
+    CPT(TransformState) localTransform = propNP.get_transform();
+    propNP.clear_transform();
+    propNP.flatten_strong();
+    propNP.set_transform(localTransform);
+
+    std::string signature = getGeometrySignature(propNP, environmentNP);
+    if (signature.empty()) { continue; }
+
+    if (propGroups.find(signature) == propGroups.end()) { signatures.push_back(signature); }
+    propGroups[signature].push_back(propNP);
+  }
+
+  PT(GeomVertexArrayFormat) instanceArrayFormat = new GeomVertexArrayFormat();
+  instanceArrayFormat->add_column
+    ( InternalName::make("instanceRotation")
+    , 4
+    , Geom::NT_float32
+    , Geom::C_other
+    );
+  instanceArrayFormat->add_column
+    ( InternalName::make("instanceOffset")
+    , 4
+    , Geom::NT_float32
+    , Geom::C_other
+    );
+  instanceArrayFormat->set_divisor(1);
+
+  CPT(GeomVertexArrayFormat) registeredInstanceArrayFormat =
+    GeomVertexArrayFormat::register_format(instanceArrayFormat);
+
+  for (std::string signature : signatures) {
+    std::vector<NodePath>& group = propGroups[signature];
+    if (group.size() < 2) { continue; }
+
+    // Each instance is a rotation, followed by the uniform scale in w, and the offset in xyz.
+    std::vector<float> instanceData;
+    bool decomposed = true;
+
+    for (NodePath propNP : group) {
+      CPT(TransformState) transform = propNP.get_transform(environmentNP);
+
+      LQuaternion rotation = transform->get_norm_quat();
+      PN_stdfloat scale    = transform->get_uniform_scale();
+      LPoint3     offset   = transform->get_pos();
+
+      // Make sure the shader will put the prop back exactly where the transform did.
+      LPoint3 probe    = LPoint3(1, 2, 3);
+      LPoint3 expected = transform->get_mat().xform_point(probe);
+      LPoint3 actual   = rotation.xform(probe * scale) + offset;
+      if (!expected.almost_equal(actual, 0.001)) { decomposed = false; break; }
+
+      instanceData.push_back(rotation.get_i());
+      instanceData.push_back(rotation.get_j());
+      instanceData.push_back(rotation.get_k());
+      instanceData.push_back(rotation.get_r());
+      instanceData.push_back(offset[0]);
+      instanceData.push_back(offset[1]);
+      instanceData.push_back(offset[2]);
+      instanceData.push_back(scale);
+    }
+
+    if (!decomposed) { continue; }
+
+    int instanceCount = group.size();
+
+    NodePath prototypeNP = group[0];
+    prototypeNP.set_state(prototypeNP.get_state(environmentNP));
+    prototypeNP.reparent_to(instancesNP);
+    prototypeNP.clear_transform();
+    prototypeNP.set_tag("instanceCount", std::to_string(instanceCount));
+
+    for (int i = 1; i < instanceCount; ++i) { group[i].remove_node(); }
+
+    NodePathCollection geomNodeCollection = prototypeNP.find_all_matches("**/+GeomNode");
+    for (int i = 0; i < geomNodeCollection.size(); ++i) {
+      PT(GeomNode) geomNode = DCAST(GeomNode, geomNodeCollection[i].node());
+
+      for (int j = 0; j < geomNode->get_num_geoms(); ++j) {
+        PT(Geom)           geom       = geomNode->modify_geom(j);
+        PT(GeomVertexData) vertexData = geom->modify_vertex_data();
+
+        PT(GeomVertexFormat) format = new GeomVertexFormat(*vertexData->get_format());
+        int arrayIndex = format->add_array(registeredInstanceArrayFormat);
+        vertexData->set_format(GeomVertexFormat::register_format(format));
+
+        PT(GeomVertexArrayDataHandle) handle = vertexData->modify_array(arrayIndex)->modify_handle();
+        handle->unclean_set_num_rows(instanceCount);
+        memcpy
+          ( handle->get_write_pointer()
+          , &instanceData[0]
+          , instanceData.size() * sizeof(float)
+          );
+      }
+    }
+  }
+  }
+
+std::string getGeometrySignature
+  ( NodePath propNP
+  , NodePath environmentNP
+  ) {
+  // Two props match when they share a render state and their geometry is byte for byte the same.
+
+  std::stringstream signature;
+  signature << propNP.get_state(environmentNP).p();
+
+  unsigned long long hash = 14695981039346656037ULL;
+
+  NodePathCollection geomNodeCollection = propNP.find_all_matches("**/+GeomNode");
+  if (geomNodeCollection.size() == 0) { return ""; }
+
+  for (int i = 0; i < geomNodeCollection.size(); ++i) {
+    PT(GeomNode) geomNode = DCAST(GeomNode, geomNodeCollection[i].node());
+
+    for (int j = 0; j < geomNode->get_num_geoms(); ++j) {
+      CPT(Geom)           geom       = geomNode->get_geom(j);
+      CPT(GeomVertexData) vertexData = geom->get_vertex_data();
+
+      signature
+        << " " << geomNode->get_geom_state(j).p()
+        << " " << vertexData->get_format()
+        << " " << vertexData->get_num_rows();
+
+      for (int k = 0; k < vertexData->get_num_arrays(); ++k) {
+        CPT(GeomVertexArrayDataHandle) handle = vertexData->get_array(k)->get_handle();
+        hash = hashBytes(handle->get_read_pointer(true), handle->get_data_size_bytes(), hash);
+      }
+
+      for (int k = 0; k < geom->get_num_primitives(); ++k) {
+        CPT(GeomPrimitive) primitive = geom->get_primitive(k);
+
+        signature
+          << " " << primitive->get_type()
+          << " " << primitive->get_first_vertex()
+          << " " << primitive->get_num_vertices();
+
+        CPT(GeomVertexArrayData) vertices = primitive->get_vertices();
+        if (vertices == nullptr) { continue; }
+
+        CPT(GeomVertexArrayDataHandle) handle = vertices->get_handle();
+        hash = hashBytes(handle->get_read_pointer(true), handle->get_data_size_bytes(), hash);
+      }
+    }
+  }
+
+  signature << " " << hash;
+
+  return signature.str();
+  }
+
+void setUpInstancedGeometry
+  ( NodePath environmentNP
+  ) {
+  NodePathCollection instancedCollection = environmentNP.find_all_matches("**/=instanceCount");
+
+  for (int i = 0; i < instancedCollection.size(); ++i) {
+    NodePath instancedNP = instancedCollection[i];
+
+    int instanceCount = std::stoi(instancedNP.get_tag("instanceCount"));
+
+    LPoint3 prototypeMin;
+    LPoint3 prototypeMax;
+    if (!instancedNP.calc_tight_bounds(prototypeMin, prototypeMax, instancedNP)) { continue; }
+
+    LPoint3     prototypeCenter = (prototypeMin + prototypeMax) * 0.5;
+    PN_stdfloat prototypeRadius = (prototypeMax - prototypeMin).length() * 0.5;
+
+    NodePath geomNP = instancedNP.find("**/+GeomNode");
+    if (geomNP.is_empty()) { continue; }
+
+    PT(GeomNode) geomNode = DCAST(GeomNode, geomNP.node());
+    if (geomNode->get_num_geoms() == 0) { continue; }
+
+    CPT(GeomVertexData) vertexData = geomNode->get_geom(0)->get_vertex_data();
+    GeomVertexReader rotationReader = GeomVertexReader(vertexData, "instanceRotation");
+    GeomVertexReader offsetReader   = GeomVertexReader(vertexData, "instanceOffset");
+    if (!rotationReader.has_column() || !offsetReader.has_column()) { continue; }
+
+    // The prototype's own bounds only cover the first copy so they're swapped for
+    // a box around every instance, which the cameras then cull as one.
+
+    LPoint3 boundsMin = LPoint3( 1e9);
+    LPoint3 boundsMax = LPoint3(-1e9);
+
+    for (int j = 0; j < instanceCount; ++j) {
+      LVecBase4 rotation = rotationReader.get_data4();
+      LVecBase4 offset   = offsetReader.get_data4();
+
+      LQuaternion quaternion = LQuaternion(rotation[3], rotation[0], rotation[1], rotation[2]);
+      LPoint3     center     = quaternion.xform(prototypeCenter * offset[3]) + offset.get_xyz();
+      LVecBase3   extent     = LVecBase3(prototypeRadius * offset[3]);
+
+      boundsMin = boundsMin.fmin(center - extent);
+      boundsMax = boundsMax.fmax(center + extent);
+    }
+
+    instancedNP.set_instance_count(instanceCount);
+    instancedNP.set_shader_input("isInstanced", LVecBase2f(1, 1));
+    instancedNP.node()->set_bounds(new BoundingBox(boundsMin, boundsMax));
+    instancedNP.node()->set_final(true);
+  }
+  }
+
+void addLevelsOfDetail
+  ( NodePath clusterNP
+  ) {
+  // The cluster becomes the first child of an LOD node and each coarser copy follows it.
+  // The switch distances depend on the lens and window so they're set at runtime.
+
+  LPoint3 clusterMin;
+  LPoint3 clusterMax;
+  if (!clusterNP.calc_tight_bounds(clusterMin, clusterMax)) { return; }
+
+  PT(LODNode) lodNode = new LODNode(clusterNP.get_name() + "Lod");
+  lodNode->set_center((clusterMin + clusterMax) * 0.5);
+
+  NodePath lodNP = clusterNP.get_parent().attach_new_node(lodNode);
+  clusterNP.reparent_to(lodNP);
+  clusterNP.set_tag("lodError", "0");
+
+  for (float cellSize : SCENE_LOD_CELL_SIZES) {
+    NodePath levelNP = clusterNP.copy_to(lodNP);
+    levelNP.set_tag("lodError", std::to_string(cellSize));
+
+    NodePathCollection geomNodeCollection = levelNP.find_all_matches("**/+GeomNode");
+    for (int i = 0; i < geomNodeCollection.size(); ++i) {
+      PT(GeomNode) geomNode = DCAST(GeomNode, geomNodeCollection[i].node());
+
+      for (int j = geomNode->get_num_geoms() - 1; j >= 0; --j) {
+        PT(Geom) simplifiedGeom = simplifyGeometry(geomNode->get_geom(j), cellSize);
+        if (simplifiedGeom == nullptr) {
+          geomNode->remove_geom(j);
+        } else {
+          geomNode->set_geom(j, simplifiedGeom);
+        }
+      }
+    }
+  }
+  }
+
+PT(Geom) simplifyGeometry
+  ( CPT(Geom) geom
+  , PN_stdfloat cellSize
+  ) {
+  // Vertices falling in the same grid cell collapse onto the first one found there
+  // and the triangles left with no area are dropped.
+  // The simplified geometry indexes into the same vertices so every level shares them.
+
+  CPT(GeomVertexData) vertexData = geom->get_vertex_data();
+
+  GeomVertexReader vertexReader = GeomVertexReader(vertexData, InternalName::get_vertex());
+  if (!vertexReader.has_column()) { return geom->make_copy(); }
+
+  std::vector<int> representatives(vertexData->get_num_rows());
+  std::map<std::tuple<long, long, long>, int> cells;
+
+  for (int row = 0; row < vertexData->get_num_rows(); ++row) {
+    LPoint3 vertex = vertexReader.get_data3();
+
+    std::tuple<long, long, long> cell =
+      std::make_tuple
+        ( (long) floor(vertex[0] / cellSize)
+        , (long) floor(vertex[1] / cellSize)
+        , (long) floor(vertex[2] / cellSize)
+        );
+
+    representatives[row] = cells.insert(std::make_pair(cell, row)).first->second;
+  }
+
+  PT(GeomTriangles) triangles = new GeomTriangles(Geom::UH_static);
+
+  for (int i = 0; i < geom->get_num_primitives(); ++i) {
+    CPT(GeomPrimitive) primitive = geom->get_primitive(i)->decompose();
+    if (primitive->get_primitive_type() != GeomPrimitive::PT_polygons) { continue; }
+
+    for (int j = 0; j < primitive->get_num_primitives(); ++j) {
+      int start = primitive->get_primitive_start(j);
+
+      int a = representatives[primitive->get_vertex(start    )];
+      int b = representatives[primitive->get_vertex(start + 1)];
+      int c = representatives[primitive->get_vertex(start + 2)];
+
+      if (a == b || b == c || a == c) { continue; }
+
+      triangles->add_vertices(a, b, c);
+    }
+  }
+
+  if (triangles->get_num_primitives() == 0) { return nullptr; }
+
+  PT(Geom) simplifiedGeom = new Geom(vertexData);
+  simplifiedGeom->add_primitive(triangles);
+
+  return simplifiedGeom;
+  }
+
+void setUpLevelsOfDetail
+  ( NodePath environmentNP
+  , PT(Lens) lens
+  , int windowHeight
+  ) {
+  // A level's error is the size of the cells it was simplified with.
+  // It takes over at the distance where that error covers SCENE_LOD_PIXEL_ERROR pixels.
+
+  PN_stdfloat unitsPerPixel =
+      2.0
+    * tan(toRadians(lens->get_fov()[1]) / 2.0)
+    / std::max(windowHeight, 1);
+
+  NodePathCollection lodCollection = environmentNP.find_all_matches("**/+LODNode");
+  for (int i = 0; i < lodCollection.size(); ++i) {
+    NodePath     lodNP   = lodCollection[i];
+    PT(LODNode)  lodNode = DCAST(LODNode, lodNP.node());
+
+    lodNode->clear_switches();
+
+    PN_stdfloat nearDistance = 0;
+    for (int j = 0; j < lodNP.get_num_children(); ++j) {
+      PN_stdfloat farDistance = 1000000;
+
+      if (j + 1 < lodNP.get_num_children()) {
+        PN_stdfloat error = std::stof(lodNP.get_child(j + 1).get_tag("lodError"));
+        farDistance = error / (SCENE_LOD_PIXEL_ERROR * unitsPerPixel);
+      }
+
+      lodNode->add_switch(farDistance, nearDistance);
+
+      nearDistance = farDistance;
+    }
+  }
+  }
+
+void setUpShadowCasters
+  ( NodePath render
+  , PT(Shader) shadowShader
+  , NodePath cameraNP
+  ) {
+  // The shadow cameras draw the scene with their own shader so the instances land where they should.
+
+  NodePath shadowNP = NodePath("shadow");
+  shadowNP.set_shader(shadowShader);
+
+  NodePathCollection lightCollection = render.find_all_matches("**/+LightLensNode");
+  for (int i = 0; i < lightCollection.size(); ++i) {
+    PT(Camera) shadowCamera = DCAST(Camera, lightCollection[i].node());
+    shadowCamera->set_initial_state
+      ( shadowCamera->get_initial_state()->compose(shadowNP.get_state())
+      );
+
+    // Pick the levels of detail as seen from the view so the shadows match what's on screen.
+    shadowCamera->set_lod_center(cameraNP);
+  }
+  }
+
+bool calculateScreenBounds
+  ( LPoint3 boundsMin
+  , LPoint3 boundsMax
+  , LMatrix4 toCamera
+  , PT(Lens) lens
+  , LVecBase4& dimensions
+  ) {
+  // Returns false when the box is off-screen or behind the camera.
+  // Otherwise the dimensions are its rectangle on screen as fractions of the window,
+  // left, right, bottom, and top, like a display region's.
+
+  LMatrix4 toClip = toCamera * lens->get_projection_mat();
+
+  PN_stdfloat left   =  1;
+  PN_stdfloat right  = -1;
+  PN_stdfloat bottom =  1;
+  PN_stdfloat top    = -1;
+
+  int behind = 0;
+
+  for (int i = 0; i < 8; ++i) {
+    LVecBase4 corner =
+      LVecBase4
+        ( (i & 1) ? boundsMax[0] : boundsMin[0]
+        , (i & 2) ? boundsMax[1] : boundsMin[1]
+        , (i & 4) ? boundsMax[2] : boundsMin[2]
+        , 1
+        );
+    LVecBase4 clip = toClip.xform(corner);
+
+    if (clip[3] <= 0) { behind += 1; continue; }
+
+    left   = std::min(left,   clip[0] / clip[3]);
+    right  = std::max(right,  clip[0] / clip[3]);
+    bottom = std::min(bottom, clip[1] / clip[3]);
+    top    = std::max(top,    clip[1] / clip[3]);
+  }
+
+  if (behind == 8) { return false; }
+
+  // Part of the box is behind the camera so its projection can't be trusted.
+  // It could reach any part of the screen.
+  if (behind > 0) {
+    dimensions = LVecBase4(0, 1, 0, 1);
+    return true;
+  }
+
+  if (right < -1 || left > 1 || top < -1 || bottom > 1) { return false; }
+
+  dimensions =
+    LVecBase4
+      ( (std::max(left,   (PN_stdfloat) -1) + 1) / 2
+      , (std::min(right,  (PN_stdfloat)  1) + 1) / 2
+      , (std::max(bottom, (PN_stdfloat) -1) + 1) / 2
+      , (std::min(top,    (PN_stdfloat)  1) + 1) / 2
+      );
+
+  return true;
+  }
+
+Filename getBakedSceneFilename
+  ( Filename sceneFilename
+  ) {
+  return Filename
+    ( sceneFilename.get_dirname()
+    , sceneFilename.get_basename_wo_extension() + "-baked.bam"
+    );
+  }
+
+std::string findBakedScene
+  ( std::string scenePath
+  ) {
+  VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
 
-  NodePath squashNP = NodePath("squash");
-  squashNP.reparent_to(environmentNP);
+  Filename sceneFilename = Filename(scenePath);
+  if (!vfs->resolve_filename(sceneFilename, get_model_path().get_value())) { return ""; }
 
-  NodePathCollection squashCollection = environmentNP.find_all_matches("**/*");
-  for (int i = 0; i < squashCollection.size(); ++i) {
-    if  (   squashCollection[i].get_name() == "wheel-lp"
-        ||  squashCollection[i].get_name() == "water-lp"
-        ||  squashCollection[i].get_name() == "squash"
+  Filename bakedSceneFilename = getBakedSceneFilename(sceneFilename);
+
+  PT(VirtualFile) sceneFile      = vfs->get_file(sceneFilename);
+  PT(VirtualFile) bakedSceneFile = vfs->get_file(bakedSceneFilename);
+  if (sceneFile == nullptr || bakedSceneFile == nullptr) { return ""; }
+
+  // A baked scene only counts when it's newer than the one it came from.
+  if (bakedSceneFile->get_timestamp() <= sceneFile->get_timestamp()) { return ""; }
+
+  return bakedSceneFilename.to_os_specific();
+  }
+
+int bakeScene
+  ( std::string scenePath
+  ) {
+  // Skip the model caches so both timings include reading the file.
+  // LF_no_cache leaves the texture pool alone, so the pools are emptied before each load too.
+  // Otherwise the baked load reuses the textures the source load just read.
+  LoaderOptions loaderOptions
+    (   LoaderOptions::LF_search
+      | LoaderOptions::LF_report_errors
+      | LoaderOptions::LF_no_cache
+    );
+
+  PT(Loader) loader = Loader::get_global_ptr();
+
+  Filename sceneFilename = Filename(scenePath);
+  if (!sceneFilename.resolve_filename(get_model_path().get_value())) {
+    printf("Could not find %s\n", scenePath.c_str());
+    return 1;
+  }
+
+  TexturePool::release_all_textures();
+  ModelPool::release_all_models();
+
+  auto squashStart = std::chrono::steady_clock::now();
+
+  PT(PandaNode) sceneNode = loader->load_sync(sceneFilename, loaderOptions);
+  if (sceneNode == nullptr) {
+    printf("Could not load %s\n", sceneFilename.c_str());
+    return 1;
+  }
+
+  NodePath environmentNP = NodePath(sceneNode);
+  squashGeometry(environmentNP);
+
+  auto squashEnd = std::chrono::steady_clock::now();
+
+  Filename bakedSceneFilename = getBakedSceneFilename(sceneFilename);
+  if (!environmentNP.write_bam_file(bakedSceneFilename)) {
+    printf("Could not write %s\n", bakedSceneFilename.c_str());
+    return 1;
+  }
+
+  sceneNode = nullptr;
+  environmentNP.clear();
+  TexturePool::release_all_textures();
+  ModelPool::release_all_models();
+
+  auto bakedStart = std::chrono::steady_clock::now();
+
+  PT(PandaNode) bakedSceneNode = loader->load_sync(bakedSceneFilename, loaderOptions);
+  if (bakedSceneNode == nullptr) {
+    printf("Could not load %s\n", bakedSceneFilename.c_str());
+    return 1;
+  }
+
+  auto bakedEnd = std::chrono::steady_clock::now();
+
+  printf
+    ( "Baked %s into %s\n"
+      "Load and squash %8.3f ms\n"
+      "Load baked      %8.3f ms\n"
+    , sceneFilename.c_str()
+    , bakedSceneFilename.c_str()
+    , std::chrono::duration<double, std::milli>(squashEnd - squashStart).count()
+    , std::chrono::duration<double, std::milli>(bakedEnd  - bakedStart ).count()
+    );
+
+  return 0;
+  }
+
+int bakeTextures
+  ( std::vector<std::string> directories
+  , std::string manifestPath
+  ) {
+  std::ofstream manifest(manifestPath.c_str());
+  if (!manifest) {
+    printf("Could not write %s\n", manifestPath.c_str());
+    return 1;
+  }
+
+  long sourceBytes = 0;
+  long bakedBytes  = 0;
+
+  for (std::string directory : directories) {
+    Filename directoryFilename = Filename(directory);
+    if (!directoryFilename.resolve_filename(get_model_path().get_value())) {
+      printf("Could not find %s\n", directory.c_str());
+      return 1;
+    }
+
+    vector_string names;
+    directoryFilename.scan_directory(names);
+
+    for (std::string name : names) {
+      Filename sourceFilename = Filename(directoryFilename, name);
+      if (sourceFilename.get_extension() != "png") { continue; }
+
+      // The lookup tables are read back on the CPU
+      // and block compression would smear the noise across each block.
+      if  (   name.find("lookup-table") == 0
+          ||  name == "color-noise.png"
+          ) { continue; }
+
+      PT(Texture) texture = new Texture(name);
+      if (!texture->read(sourceFilename)) {
+        printf("Could not load %s\n", sourceFilename.c_str());
+        return 1;
+      }
+
+      std::string format;
+      PT(Texture) bakedTexture = bakeTexture(texture, name, format);
+
+      Filename bakedFilename =
+        Filename
+          ( directoryFilename
+          , sourceFilename.get_basename_wo_extension() + ".txo"
+          );
+      if (!bakedTexture->write(bakedFilename)) {
+        printf("Could not write %s\n", bakedFilename.c_str());
+        return 1;
+      }
+
+      sourceBytes += sourceFilename.get_file_size();
+      bakedBytes  += bakedFilename.get_file_size();
+
+      size_t imageBytes = 0;
+      for (int n = 0; n < bakedTexture->get_num_ram_mipmap_images(); ++n) {
+        imageBytes += bakedTexture->get_ram_mipmap_image_size(n);
+      }
+
+      printf
+        ( "%-32s %-4s %5d x %-5d %2d levels %9.1f KiB\n"
+        , name.c_str()
+        , format.c_str()
+        , bakedTexture->get_x_size()
+        , bakedTexture->get_y_size()
+        , bakedTexture->get_num_ram_mipmap_images()
+        , imageBytes / 1024.0
+        );
+
+      manifest
+        << directory + "/" + name
+        << " "
+        << sourceFilename.get_file_size()
+        << " "
+        << (long long) sourceFilename.get_timestamp()
+        << " "
+        << directory + "/" + bakedFilename.get_basename()
+        << " "
+        << format
+        << "\n";
+    }
+  }
+
+  printf
+    ( "Baked %.1f MiB of PNGs into %.1f MiB of TXOs\n"
+    , sourceBytes / (1024.0 * 1024.0)
+    , bakedBytes  / (1024.0 * 1024.0)
+    );
+
+  return 0;
+  }
+
+PT(Texture) bakeTexture
+  ( PT(Texture) texture
+  , std::string name
+  , std::string& format
+  ) {
+  std::string basename = Filename(name).get_basename_wo_extension();
+
+  auto endsWith =
+    [&basename](std::string suffix) -> bool {
+      return  basename.size() >= suffix.size()
+          &&  basename.compare(basename.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+
+  PT(Texture) bakedTexture;
+
+  // The normal and flow maps only need their red and green.
+  if (basename == "normal" || endsWith("-normal") || endsWith("-flow")) {
+    bakedTexture = compressBc5Texture(texture);
+    format       = "BC5";
+  } else {
+    bool hasAlpha = texture->get_num_components() == 2 || texture->get_num_components() == 4;
+
+    bakedTexture = texture;
+    bakedTexture->generate_ram_mipmap_images();
+
+    format = hasAlpha ? "BC3" : "BC1";
+
+    // Panda compresses with squish when it was built with it.
+    if (!bakedTexture->compress_ram_image(hasAlpha ? Texture::CM_dxt5 : Texture::CM_dxt1, Texture::QL_best)) {
+      format = "RAW";
+    }
+  }
+
+  if (bakedTexture->get_minfilter() == SamplerState::FT_default) {
+    bakedTexture->set_minfilter(SamplerState::FT_linear_mipmap_linear);
+  }
+
+  return bakedTexture;
+  }
+
+PT(Texture) compressBc5Texture
+  ( PT(Texture) texture
+  ) {
+  PNMImage level;
+  texture->store(level);
+
+  PT(Texture) bakedTexture = new Texture(texture->get_name());
+  bakedTexture->setup_2d_texture
+    ( level.get_x_size()
+    , level.get_y_size()
+    , Texture::T_unsigned_byte
+    , Texture::F_rg
+    );
+  bakedTexture->set_default_sampler(texture->get_default_sampler());
+
+  for (int n = 0; ; ++n) {
+    int xSize   = level.get_x_size();
+    int ySize   = level.get_y_size();
+    int xBlocks = (xSize + 3) / 4;
+    int yBlocks = (ySize + 3) / 4;
+
+    PTA_uchar image = PTA_uchar::empty_array(xBlocks * yBlocks * 16);
+
+    unsigned char red[16];
+    unsigned char green[16];
+
+    for (int by = 0; by < yBlocks; ++by) {
+      for (int bx = 0; bx < xBlocks; ++bx) {
+        for (int i = 0; i < 16; ++i) {
+          // Texture rows run bottom to top while the image rows run top to bottom.
+          int x = std::min(bx * 4 + (i % 4), xSize - 1);
+          int y = ySize - 1 - std::min(by * 4 + (i / 4), ySize - 1);
+
+          red[i]   = (unsigned char) std::round(level.get_red(  x, y) * 255.0);
+          green[i] = (unsigned char) std::round(level.get_green(x, y) * 255.0);
+        }
+
+        unsigned char* block = &image[(by * xBlocks + bx) * 16];
+
+        compressBc4Block(red,   block    );
+        compressBc4Block(green, block + 8);
+      }
+    }
+
+    if (n == 0) {
+      bakedTexture->set_ram_image(image, Texture::CM_rgtc);
+    } else {
+      bakedTexture->set_ram_mipmap_image(n, image);
+    }
+
+    if (xSize == 1 && ySize == 1) { break; }
+
+    PNMImage nextLevel
+      ( std::max(1, xSize / 2)
+      , std::max(1, ySize / 2)
+      , level.get_num_channels()
+      , level.get_maxval()
+      );
+    nextLevel.quick_filter_from(level);
+
+    level = nextLevel;
+  }
+
+  return bakedTexture;
+  }
+
+void compressBc4Block
+  ( unsigned char values[16]
+  , unsigned char* block
+  ) {
+  unsigned char low  = 255;
+  unsigned char high = 0;
+
+  for (int i = 0; i < 16; ++i) {
+    low  = std::min(low,  values[i]);
+    high = std::max(high, values[i]);
+  }
+
+  // With the first endpoint above the second, the six codes in between
+  // step evenly from the high endpoint down to the low one.
+
+  block[0] = high;
+  block[1] = low;
+
+  unsigned long long codes = 0;
+
+  if (high > low) {
+    for (int i = 0; i < 16; ++i) {
+      int step = (int) std::round(7.0 * (high - values[i]) / (high - low));
+      int code = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+
+      codes |= ((unsigned long long) code) << (3 * i);
+    }
+  }
+
+  for (int i = 0; i < 6; ++i) {
+    block[2 + i] = (codes >> (8 * i)) & 0xFF;
+  }
+  }
+
+std::vector<BakedTexture> loadTextureManifest
+  ( std::string manifestPath
+  ) {
+  std::vector<BakedTexture> bakedTextures;
+
+  VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+
+  Filename manifestFilename = Filename(manifestPath);
+  if (!vfs->resolve_filename(manifestFilename, get_model_path().get_value())) { return bakedTextures; }
+
+  std::istringstream manifest(vfs->read_file(manifestFilename, true));
+
+  BakedTexture bakedTexture;
+  std::string  format;
+
+  while
+    (   manifest
+          >> bakedTexture.sourcePath
+          >> bakedTexture.sourceSize
+          >> bakedTexture.sourceTimestamp
+          >> bakedTexture.bakedPath
+          >> format
+    ) {
+    Filename sourceFilename = Filename(bakedTexture.sourcePath);
+    Filename bakedFilename  = Filename(bakedTexture.bakedPath);
+
+    if (!vfs->resolve_filename(sourceFilename, get_model_path().get_value())) { continue; }
+    if (!vfs->resolve_filename(bakedFilename,  get_model_path().get_value())) { continue; }
+
+    // A source that changed since the bake has to be loaded as is.
+    // Its size and time stamp are enough to tell without reading it.
+    PT(VirtualFile) sourceFile = vfs->get_file(sourceFilename, true);
+    if  (   sourceFile == nullptr
+        ||  (long long) sourceFile->get_file_size()  != bakedTexture.sourceSize
+        ||  (long long) sourceFile->get_timestamp()  != bakedTexture.sourceTimestamp
         ) { continue; }
-    squashCollection[i].reparent_to(squashNP);
+
+    bakedTextures.push_back(bakedTexture);
+  }
+
+  return bakedTextures;
+  }
+
+void preloadBakedTextures
+  ( std::vector<BakedTexture> bakedTextures
+  ) {
+  VirtualFileSystem* vfs = VirtualFileSystem::get_global_ptr();
+
+  for (BakedTexture& bakedTexture : bakedTextures) {
+    Filename sourceFilename = Filename(bakedTexture.sourcePath);
+    Filename bakedFilename  = Filename(bakedTexture.bakedPath);
+
+    vfs->resolve_filename(sourceFilename, get_model_path().get_value());
+    vfs->resolve_filename(bakedFilename,  get_model_path().get_value());
+
+    PT(Texture) texture = new Texture();
+    if (!texture->read(bakedFilename)) { continue; }
+
+    // The pool is keyed by the full path so the TXO stands in for its PNG.
+    texture->set_filename(bakedTexture.sourcePath);
+    texture->set_fullpath(sourceFilename);
+
+    TexturePool::add_texture(texture);
+  }
+  }
+
+unsigned long long hashBytes
+  ( const unsigned char* bytes
+  , size_t size
+  , unsigned long long hash
+  ) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+  }
+
+int packAssets
+  ( std::vector<std::string> paths
+  , std::string archivePath
+  ) {
+  Filename archiveFilename = Filename::binary_filename(archivePath);
+  Filename partialFilename = Filename::binary_filename(archivePath + ".partial");
+
+  // The archive is mounted over the loose files so a partial or stale one would hide edits to them.
+  // It's written to the side and only replaces the old one once every asset made it in.
+  // If any asset fails, the old archive is removed too.
+  auto failed =
+    [&](PT(Multifile) multifile) -> int {
+      if (multifile != nullptr) { multifile->close(); }
+      partialFilename.unlink();
+      if (archiveFilename.exists() && archiveFilename.unlink()) {
+        printf("Removed the out of date %s\n", archivePath.c_str());
+      }
+      return 1;
+    };
+
+  PT(Multifile) multifile = new Multifile();
+  if (!multifile->open_write(partialFilename)) {
+    printf("Could not write %s\n", partialFilename.c_str());
+    return failed(nullptr);
+  }
+
+  // Every subfile starts on a page boundary of the mapped archive.
+  multifile->set_scale_factor(ASSET_ARCHIVE_ALIGNMENT);
+
+  int numberOfAssets = 0;
+  int numberOfFailed = 0;
+
+  std::function<void(std::string, Filename)> addPath =
+    [&](std::string name, Filename filename) -> void {
+      if (filename.is_directory()) {
+        vector_string names;
+        filename.scan_directory(names);
+        for (std::string child : names) { addPath(name + "/" + child, Filename(filename, child)); }
+        return;
+      }
+
+      // Stored uncompressed so they can be read straight out of the mapping.
+      if (multifile->add_subfile(name, filename, 0).empty()) {
+        printf("Could not add %s\n", name.c_str());
+        numberOfFailed += 1;
+        return;
+      }
+
+      numberOfAssets += 1;
+    };
+
+  for (std::string path : paths) {
+    Filename filename = Filename(path);
+    if (!filename.resolve_filename(get_model_path().get_value())) {
+      printf("Could not find %s\n", path.c_str());
+      return failed(multifile);
+    }
+
+    addPath(path, filename);
+  }
+
+  if (numberOfFailed > 0) {
+    printf("Could not add %d assets so %s was not written\n", numberOfFailed, archivePath.c_str());
+    return failed(multifile);
+  }
+
+  if (!multifile->flush()) {
+    printf("Could not write %s\n", partialFilename.c_str());
+    return failed(multifile);
+  }
+  multifile->close();
+
+  if (!partialFilename.rename_to(archiveFilename)) {
+    printf("Could not move %s to %s\n", partialFilename.c_str(), archivePath.c_str());
+    return failed(nullptr);
+  }
+
+  printf
+    ( "Packed %d assets into %s (%.1f MiB)\n"
+    , numberOfAssets
+    , archivePath.c_str()
+    , archiveFilename.get_file_size() / (1024.0 * 1024.0)
+    );
+
+  return 0;
+  }
+
+bool mountAssetArchive
+  ( AssetArchive& archive
+  , std::string archivePath
+  ) {
+  archive.data      = nullptr;
+  archive.size      = 0;
+  archive.buffer    = nullptr;
+  archive.stream    = nullptr;
+  archive.multifile = nullptr;
+
+  Filename archiveFilename = Filename::binary_filename(archivePath);
+  if (!archiveFilename.resolve_filename(get_model_path().get_value())) { return false; }
+
+  int descriptor = open(archiveFilename.to_os_specific().c_str(), O_RDONLY);
+  if (descriptor < 0) { return false; }
+
+  size_t size = archiveFilename.get_file_size();
+  void*  data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+  close(descriptor);
+
+  if (data == MAP_FAILED) { return false; }
+
+  // One long sequential read ahead instead of a seek per asset.
+  madvise(data, size, MADV_WILLNEED);
+
+  archive.data      = data;
+  archive.size      = size;
+  archive.buffer    = new MappedArchiveBuffer((char*) data, size);
+  archive.stream    = new std::istream(archive.buffer);
+  archive.multifile = new Multifile();
+
+  if (!archive.multifile->open_read(new IStreamWrapper(archive.stream, false), true)) {
+    unmountAssetArchive(archive);
+    return false;
+  }
+
+  // Mounted over the directory the loose files live in
+  // so every relative path resolves to the archived copy first.
+
+  Filename mainDirectory = Filename(ExecutionEnvironment::expand_string("$MAIN_DIR"));
+
+  VirtualFileSystem::get_global_ptr()->mount
+    ( archive.multifile
+    , mainDirectory
+    , VirtualFileSystem::MF_read_only
+    );
+
+  // The archived copy wins over the loose file, so point out any loose file edited after the pack.
+  time_t archiveTimestamp = archiveFilename.get_timestamp();
+  int    newerFiles       = 0;
+  for (int i = 0; i < archive.multifile->get_num_subfiles(); ++i) {
+    Filename looseFilename = Filename(mainDirectory, archive.multifile->get_subfile_name(i));
+    if (looseFilename.exists() && looseFilename.get_timestamp() > archiveTimestamp) {
+      if (newerFiles < 5) { printf("%s is newer than %s\n", looseFilename.c_str(), archivePath.c_str()); }
+      newerFiles += 1;
+    }
+  }
+  if (newerFiles > 0) {
+    printf
+      ( "%d loose files are newer than %s and are hidden by it. Rebake or delete it to use them.\n"
+      , newerFiles
+      , archivePath.c_str()
+      );
+  }
+
+  return true;
+  }
+
+void unmountAssetArchive
+  ( AssetArchive& archive
+  ) {
+  if (archive.multifile != nullptr) {
+    VirtualFileSystem::get_global_ptr()->unmount(archive.multifile);
+    archive.multifile->close();
+    archive.multifile = nullptr;
+  }
+
+  delete archive.stream;
+  delete archive.buffer;
+
+  archive.stream = nullptr;
+  archive.buffer = nullptr;
+
+  if (archive.data != nullptr) {
+    munmap(archive.data, archive.size);
+    archive.data = nullptr;
   }
-  squashNP.flatten_strong();
   }
 
 double microsecondToSecond
-  ( int m
+  ( long long m
   ) {
   return m / 1000000.0;
   }
@@ -2741,6 +6852,81 @@ void setTextureToNearestAndClamp
     texture->set_wrap_w(SamplerState::WM_clamp);
   }
 
+void setTextureToLinearAndClamp
+  ( PT(Texture) texture
+  ) {
+    texture->set_magfilter(SamplerState::FT_linear);
+    texture->set_minfilter(SamplerState::FT_linear);
+    texture->set_wrap_u(SamplerState::WM_clamp);
+    texture->set_wrap_v(SamplerState::WM_clamp);
+    texture->set_wrap_w(SamplerState::WM_clamp);
+  }
+
+PT(Texture) generateLookupTableTexture
+  ( PT(Texture) lookupTableStrip
+  ) {
+    // The strip lays the blue slices side by side with red across each slice
+    // and green going down the rows.
+
+    PNMImage strip;
+    lookupTableStrip->store(strip);
+
+    int size = strip.get_y_size();
+
+    PT(Texture) lookupTable = new Texture(lookupTableStrip->get_name() + "3d");
+    lookupTable->setup_3d_texture
+      ( size
+      , size
+      , size
+      , Texture::T_unsigned_byte
+      , Texture::F_rgb8
+      );
+
+    // Panda keeps the RAM image as BGR with the rows going bottom to top.
+
+    PTA_uchar image = lookupTable->modify_ram_image();
+
+    for (int b = 0; b < size; ++b) {
+      for (int g = 0; g < size; ++g) {
+        for (int r = 0; r < size; ++r) {
+          LRGBColorf color = strip.get_xel(b * size + r, g);
+          int        i     = ((b * size + g) * size + r) * 3;
+
+          image[i + 0] = (unsigned char) (color[2] * 255.0 + 0.5);
+          image[i + 1] = (unsigned char) (color[1] * 255.0 + 0.5);
+          image[i + 2] = (unsigned char) (color[0] * 255.0 + 0.5);
+        }
+      }
+    }
+
+    setTextureToLinearAndClamp(lookupTable);
+
+    return lookupTable;
+  }
+
+void blendLookupTableTextures
+  ( PT(Texture) a
+  , PT(Texture) b
+  , PT(Texture) result
+  , float amount
+  ) {
+    CPTA_uchar imageA      = a->get_ram_image();
+    CPTA_uchar imageB      = b->get_ram_image();
+    PTA_uchar  imageResult = result->modify_ram_image();
+
+    int size = std::min(imageA.size(), std::min(imageB.size(), imageResult.size()));
+
+    for (int i = 0; i < size; ++i) {
+      imageResult[i] =
+        (unsigned char)
+          ( imageA[i]
+          + (imageB[i] - imageA[i])
+          * amount
+          + 0.5
+          );
+    }
+  }
+
 LColor mixColor
   ( LColor a
   , LColor b
@@ -2748,3 +6934,82 @@ LColor mixColor
   ) {
     return a * (1 - factor) + b * factor;
   }
+
+void updateMotionTrackedNodes
+  ( NodePath render
+  , std::vector<MotionTrackedNode>& motionTrackedNodes
+  ) {
+  // The motion matrix maps this frame's world positions
+  // back to where they were last frame.
+
+  for (MotionTrackedNode& motionTrackedNode : motionTrackedNodes) {
+    LMatrix4 currentWorldMat = motionTrackedNode.nodePath.get_transform(render)->get_mat();
+
+    motionTrackedNode.nodePath.set_shader_input
+      ( "motionMat"
+      , invert(currentWorldMat) * motionTrackedNode.previousWorldMat
+      );
+
+    motionTrackedNode.previousWorldMat = currentWorldMat;
+
+    // The joints still hold last frame's pose until this frame is culled,
+    // so skinning the vertices now gives the positions they're moving from.
+
+    for (PT(GeomNode) geomNode : motionTrackedNode.skinnedGeomNodes) {
+      for (int i = 0; i < geomNode->get_num_geoms(); ++i) {
+        CPT(GeomVertexData) animatedVertexData =
+          geomNode->get_geom(i)->get_animated_vertex_data(true, Thread::get_current_thread());
+        PT(GeomVertexData) vertexData = geomNode->modify_geom(i)->modify_vertex_data();
+
+        GeomVertexReader vertexReader         = GeomVertexReader(animatedVertexData, InternalName::get_vertex());
+        GeomVertexWriter previousVertexWriter = GeomVertexWriter(vertexData, "previousVertex");
+        while (!vertexReader.is_at_end()) {
+          previousVertexWriter.set_data3f(vertexReader.get_data3f());
+        }
+      }
+    }
+  }
+  }
+
+void trackSkinnedVertices
+  ( MotionTrackedNode& motionTrackedNode
+  ) {
+  // The joints move these vertices on the CPU, so the velocity shader never sees a moving vertex.
+  // They get a column to hold where each one was last frame.
+  // It isn't a point column so the skinning copies it through as is.
+
+  PT(GeomVertexArrayFormat) previousVertexArrayFormat = new GeomVertexArrayFormat();
+  previousVertexArrayFormat->add_column
+    ( InternalName::make("previousVertex")
+    , 3
+    , Geom::NT_float32
+    , Geom::C_other
+    );
+
+  CPT(GeomVertexArrayFormat) registeredPreviousVertexArrayFormat =
+    GeomVertexArrayFormat::register_format(previousVertexArrayFormat);
+
+  NodePathCollection geomNodeCollection = motionTrackedNode.nodePath.find_all_matches("**/+GeomNode");
+  for (int i = 0; i < geomNodeCollection.size(); ++i) {
+    PT(GeomNode) geomNode = DCAST(GeomNode, geomNodeCollection[i].node());
+    bool         skinned  = false;
+
+    for (int j = 0; j < geomNode->get_num_geoms(); ++j) {
+      if (geomNode->get_geom(j)->get_vertex_data()->get_transform_blend_table() == nullptr) { continue; }
+
+      PT(GeomVertexData) vertexData = geomNode->modify_geom(j)->modify_vertex_data();
+
+      PT(GeomVertexFormat) format = new GeomVertexFormat(*vertexData->get_format());
+      int arrayIndex = format->add_array(registeredPreviousVertexArrayFormat);
+      vertexData->set_format(GeomVertexFormat::register_format(format));
+      vertexData->modify_array(arrayIndex)->set_num_rows(vertexData->get_num_rows());
+
+      skinned = true;
+    }
+
+    if (!skinned) { continue; }
+
+    geomNodeCollection[i].set_shader_input("isSkinned", LVecBase2f(1, 1));
+    motionTrackedNode.skinnedGeomNodes.push_back(geomNode);
+  }
+  }